@@ -12,6 +12,18 @@ namespace AW {
 #define __AW_LITTLE_ENDIAN__
 //#endif
 #define __AW_UTF8__
+// negotiated zlib compression of large messages, link with zlib when enabled
+//#define __AW_ZLIB__
+// shared memory transport for local sessions
+#ifdef __linux__
+#define __AW_SHM__
+#endif
+// io_uring for server sessions, Linux 6.0 or later; plain sockets where the kernel refuses it
+//#define __AW_IO_URING__
+// SSE2 scan of text format headers, plain loops elsewhere
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define __AW_SSE2__
+#endif
 
 #ifndef _M_IX86
 	#define __FUNCDNAME__ "func"
@@ -52,6 +64,7 @@ namespace AW {
 	typedef unsigned int	uint32;
 	typedef int				int32;
 	typedef double			real64;
+	typedef unsigned long long	uint64;
 
 #endif
 
@@ -73,13 +86,45 @@ namespace AW {
 	constexpr uint32 WORKER_PORT_START = 23522;
 	constexpr uint32 MAX_PORTS = 1000;
 	constexpr uint32 COMMUNICATION_PORT_START = 25523;
+	// a port per session client has this long to connect to its port
+	constexpr uint32 LEGACY_ACCEPT_TIMEOUT_MS = 10000;
 	constexpr uint32 RECV_SEND_INTERVAL_MS = 10;
 
 
     constexpr character* CALLBACK_FUNC_NAME = t("___callback");
     constexpr character* NOP = t("__NOP");
+	constexpr const character* HELLO_FUNC_NAME = t("__HELLO");
+	constexpr const character* CREDIT_FUNC_NAME = t("__CREDIT");
+	constexpr const character* METHODS_FUNC_NAME = t("__METHODS");
 
 	constexpr uint32 PACKET_MAX_LENGTH = 1400;
+	// socket reads of a framed connection go into chunks of at least this size
+	constexpr uint32 FRAME_BUFFER_LENGTH = 64 * 1024;
+	// longer messages are refused before anything is allocated for them
+	constexpr uint32 DEFAULT_MAX_MESSAGE_LENGTH = 64 * 1024 * 1024;
+	// streamed replies go out in chunks of about this many bytes
+	constexpr uint32 STREAM_CHUNK_LENGTH = 64 * 1024;
+	// chunks a stream may send before the reader acknowledges them
+	constexpr uint32 STREAM_WINDOW = 4;
+	// stream handlers a connection may have running at once, more are refused
+	constexpr uint32 MAX_STREAMS_PER_CONNECTION = 4;
+	// threads running the stream handlers of all sessions
+	constexpr uint32 DEFAULT_STREAM_THREAD_COUNT = 8;
+	// smaller messages are never compressed
+	constexpr uint32 COMPRESSION_THRESHOLD = 1024;
+	// smaller messages are sent without a string table
+	constexpr uint32 INTERNING_THRESHOLD = 256;
+	// bytes per direction of a shared memory session, a power of two
+	constexpr uint32 SHM_RING_LENGTH = 1 << 20;
+	// checks of an empty or full ring before sleeping on it
+	constexpr uint32 SHM_SPIN_COUNT = 2000;
+	// submission queue entries of the io_uring
+	constexpr uint32 URING_ENTRIES = 1024;
+	// receive blocks shared by all io_uring sessions, a power of two up to 32768
+	constexpr uint32 URING_BUFFER_COUNT = 512;
+	constexpr uint32 URING_BUFFER_LENGTH = 16 * 1024;
+	// the kernel's submission polling thread sleeps after this long without work
+	constexpr uint32 URING_SQ_POLL_IDLE_MS = 50;
 };
 
 #endif
\ No newline at end of file
@@ -1,10 +1,15 @@
 
 #include "ArchDeps.h"
 #include "AwSocket.h"
+#include "StringTable.h"
 
 #include <boost/asio.hpp>
 #include <thread>
 #include <memory>
+#include <array>
+#ifdef __AW_ZLIB__
+#include <zlib.h>
+#endif
 
 using namespace std;
 
@@ -38,129 +43,427 @@ namespace AW {
 		offset += sizeof(Type);
 	}
 
-	AwSocket::AwSocket(std::shared_ptr<byte> firstPacket, uint32 offset, uint32 length) {
-		packetsRemaining = readUInt32AndMove(firstPacket, offset);
-		totalLength = readUInt32AndMove(firstPacket, offset);
-		bufferLength = totalLength;
-		buffer = std::shared_ptr<byte>(new byte[bufferLength]);
+	AW::string AwSocket::receiveString(std::shared_ptr<SocketType> sock) {
+		AW::uint32 length = 0;
+		auto buffer = receivePackets(sock, length);
+		return AW::string((AW::character*)buffer.get(), length);
+	}
 
-		uint32 currentDataLength = readUInt32AndMove(firstPacket, offset);
-		if (sizeof(uint32) * 2 + currentDataLength > length)
-			throw new std::overflow_error(__FUNCDNAME__);
+	void AwSocket::sendString(std::shared_ptr<SocketType> sock, const AW::string& str) {
+		sendPackets(sock, reinterpret_cast<const byte*>(str.data()), str.size() * sizeof(AW::character));
+	}
 
-		memcpy(buffer.get(), firstPacket.get() + offset, currentDataLength);
-		currentPosition = currentDataLength;
+#ifdef __AW_ZLIB__
+	// false when it would not save anything
+	static bool compressMessage(const byte* data, uint32 length, ByteBuffer& out) {
+		uLongf size = compressBound(length);
+		out.resize(1 + varintSize(length) + size);
+		byte* p = out.data();
+		*p++ = COMPRESSED_MARKER;
+		writeVarint(p, length);
+		uint32 header = p - out.data();
+		if (compress2(p, &size, data, length, Z_BEST_SPEED) != Z_OK || header + size >= length)
+			return false;
+		out.resize(header + size);
+		return true;
 	}
-	AwSocket::AwSocket(uint32 packetsRemaining, uint32 totalLength, std::shared_ptr<byte> data, uint32 length)
-		:packetsRemaining(packetsRemaining), totalLength(totalLength), buffer(data), currentPosition(0), bufferLength(length) {
+	static std::shared_ptr<byte> decompressMessage(const byte* data, uint32& length, uint32 maxLength) {
+		uint32 offset = 1;
+		uLongf size = readVarint(data, length, offset);
+		assert_format(size > 0);
+		if (size > maxLength)
+			throw std::runtime_error("message too large");
+		uint32 capacity = 0;
+		auto ret = BufferPool::global().lease(size, capacity);
+		uLongf expected = size;
+		if (uncompress(ret.get(), &size, data + offset, length - offset) != Z_OK || size != expected)
+			throw std::runtime_error("wrong format");
+		length = size;
+		return ret;
 	}
-	void AwSocket::addPacket(std::shared_ptr<byte> data, uint32 offset, uint32 length) {
-		if (packetsRemaining <= 0)
-			throw std::invalid_argument("packets completed!");
-		uint32 packetsRemaining2 = readUInt32AndMove(data, offset);
-		if (packetsRemaining2 != packetsRemaining - 1)
-			throw std::runtime_error(__FUNCSIG__);
-		packetsRemaining = packetsRemaining2;
+#endif
 
-		if (totalLength != readUInt32AndMove(data, offset))
-			throw std::runtime_error(__FUNCSIG__);
+	std::shared_ptr<byte> AwSocket::receiveMessage(std::shared_ptr<Connection> conn, uint32& length, const ProgressFunc& progress) {
+		uint32 requestId = 0;
+		return receiveMessage(conn, length, requestId, progress);
+	}
+	std::shared_ptr<byte> AwSocket::receiveMessage(std::shared_ptr<Connection> conn, uint32& length, uint32& requestId, const ProgressFunc& progress) {
+		requestId = 0;
+		auto buffer = (conn->getFeatures() & FeatureFraming) ? receiveFrame(conn, length, requestId, progress) : receivePackets(conn->getSocket(), length, conn->getMaxMessageLength(), progress);
+		if (length == 0)
+			throw std::runtime_error("disconnect");
+#ifdef __AW_ZLIB__
+		if ((conn->getFeatures() & FeatureCompression) && buffer.get()[0] == COMPRESSED_MARKER)
+			return decompressMessage(buffer.get(), length, conn->getMaxMessageLength());
+#endif
+		return buffer;
+	}
 
-		uint32 currentDataLength = readUInt32AndMove(data, offset);
-		if (sizeof(uint32) * 2 + currentDataLength > length)
-			throw new std::overflow_error(__FUNCDNAME__);
-		memcpy(buffer.get() + currentPosition, data.get() + offset, currentDataLength);
-		currentPosition += currentDataLength;
+	std::shared_ptr<byte> AwSocket::receiveReply(std::shared_ptr<Connection> conn, uint32& length, uint32 requestId) {
+		if (!(conn->getFeatures() & FeatureRequestIds)) {
+			auto buffer = receiveMessage(conn, length);
+			throwIfError(buffer.get(), length);
+			return buffer;
+		}
+		std::shared_ptr<byte> buffer;
+		std::unique_lock<std::mutex> lock(conn->replyLock);
+		while (buffer == nullptr) {
+			auto kept = conn->replies.find(requestId);
+			if (kept != conn->replies.end()) {
+				buffer = kept->second.front().first;
+				length = kept->second.front().second;
+				kept->second.pop_front();
+				if (kept->second.empty())
+					conn->replies.erase(kept);
+				break;
+			}
+			if (conn->replyReading) {
+				conn->replyArrived.wait(lock);
+				continue;
+			}
+			// nobody is reading, this caller does until its own reply comes
+			conn->replyReading = true;
+			lock.unlock();
+			uint32 received = 0, id = 0;
+			std::shared_ptr<byte> message;
+			try {
+				message = receiveMessage(conn, received, id);
+			}
+			catch (...) {
+				// the others find out for themselves
+				lock.lock();
+				conn->replyReading = false;
+				conn->replyArrived.notify_all();
+				throw;
+			}
+			lock.lock();
+			conn->replyReading = false;
+			conn->replyArrived.notify_all();
+			if (id == requestId) {
+				buffer = message;
+				length = received;
+			}
+			// nobody waits for the rest of a call whose caller gave up
+			else if (conn->expected.count(id) != 0)
+				conn->replies[id].push_back(std::make_pair(message, received));
+		}
+		lock.unlock();
+		throwIfError(buffer.get(), length);
+		return buffer;
 	}
 
-	bool AwSocket::isDone() const {
-		return packetsRemaining == 0;
+	// frames and sends a message that is interned and compressed already, call with sendLock held
+	static void sendFramed(std::shared_ptr<Connection> conn, const byte* data, uint32 length, uint32 requestId) {
+		if (conn->getFeatures() & FeatureRequestIds)
+			AwSocket::sendFrame(conn->getSocket(), data, length, requestId);
+		else if (conn->getFeatures() & FeatureFraming)
+			AwSocket::sendFrame(conn->getSocket(), data, length);
+		else
+			AwSocket::sendPackets(conn->getSocket(), data, length);
 	}
-	std::shared_ptr<byte> AwSocket::getPacketData(uint32& length) const {
-		if (packetsRemaining != 0)
-			throw std::runtime_error(__FUNCDNAME__);
-		length = totalLength;
 
-		std::shared_ptr<byte> ret(new byte[length]);
-		memcpy(ret.get(), buffer.get(), length);
-		return ret;
+	void AwSocket::sendMessage(std::shared_ptr<Connection> conn, const byte* data, uint32 length, uint32 requestId) {
+		// one message on the wire at a time, the scratch buffers keep their capacity
+		std::lock_guard<std::mutex> lock(conn->sendLock);
+		if ((conn->getFeatures() & FeatureInterning) && length >= INTERNING_THRESHOLD && StringInterner(data, length).intern(conn->interned)) {
+			data = conn->interned.data();
+			length = conn->interned.size();
+		}
+#ifdef __AW_ZLIB__
+		if ((conn->getFeatures() & FeatureCompression) && length >= COMPRESSION_THRESHOLD && compressMessage(data, length, conn->compressed)) {
+			data = conn->compressed.data();
+			length = conn->compressed.size();
+		}
+#endif
+		sendFramed(conn, data, length, requestId);
 	}
-	std::shared_ptr<byte> AwSocket::toByteArray(uint32& length) const {
-		length = 3 * sizeof(uint32) + bufferLength;
-		std::shared_ptr<byte> ret(new byte[length]);
-		uint32 offset = 0;
-		writeUInt32AndMove(ret, offset, packetsRemaining);
-		writeUInt32AndMove(ret, offset, totalLength);
-		writeUInt32AndMove(ret, offset, bufferLength);
-		memcpy(ret.get() + offset, buffer.get(), bufferLength);
-		return ret;
+	void AwSocket::packMessage(std::shared_ptr<Connection> conn, const byte* data, uint32 length, ByteBuffer& packed) {
+		ByteBuffer interned;
+		if ((conn->getFeatures() & FeatureInterning) && length >= INTERNING_THRESHOLD && StringInterner(data, length).intern(interned)) {
+			data = interned.data();
+			length = interned.size();
+		}
+#ifdef __AW_ZLIB__
+		if ((conn->getFeatures() & FeatureCompression) && length >= COMPRESSION_THRESHOLD && compressMessage(data, length, packed))
+			return;
+#endif
+		packed.assign(data, data + length);
+	}
+	void AwSocket::sendPacked(std::shared_ptr<Connection> conn, const byte* data, uint32 length, uint32 requestId) {
+		std::lock_guard<std::mutex> lock(conn->sendLock);
+		sendFramed(conn, data, length, requestId);
 	}
 
-	AW::string AwSocket::receiveString(std::shared_ptr<boost::asio::ip::tcp::socket>& sock) {
-		AW::uint32 length = 0;
-		auto buffer = receivePackets(sock, length);
-		return AW::string((AW::character*)buffer.get(), length);
+	std::shared_ptr<ElementBase> AwSocket::receiveElement(std::shared_ptr<Connection> conn) {
+		uint32 length = 0;
+		auto buffer = receiveMessage(conn, length);
+		return Decoder(buffer, length).decode();
 	}
 
-	void AwSocket::sendString(std::shared_ptr<boost::asio::ip::tcp::socket> sock, const AW::string& str) {
-		uint32 length = str.size() * sizeof(AW::character);
-		auto buffer = new byte[length];
-		std::copy(str.begin(), str.end(), buffer);
-		sendPackets(sock, std::shared_ptr<byte>((byte*)buffer), 0, length);
+	void AwSocket::receiveDocument(std::shared_ptr<Connection> conn, FlatDocument& doc, bool lazy) {
+		uint32 requestId = 0;
+		receiveDocument(conn, doc, lazy, requestId);
+	}
+	void AwSocket::receiveDocument(std::shared_ptr<Connection> conn, FlatDocument& doc, bool lazy, uint32& requestId) {
+		// decoded while it arrives; a compressed message only once it is inflated
+		auto& decoder = conn->getDecoder();
+		decoder.reset(doc, lazy);
+		bool compressed = false;
+		ProgressFunc progress = [&](const byte* data, uint32 received, uint32 length) -> void {
+			if (received > 0 && (conn->getFeatures() & FeatureCompression) && data[0] == COMPRESSED_MARKER)
+				compressed = true;
+			if (!compressed)
+				decoder.push(data, received, length);
+		};
+		uint32 length = 0;
+		auto buffer = receiveMessage(conn, length, requestId, progress);
+		if (compressed)
+			decoder.reset(doc, lazy);
+		decoder.push(buffer.get(), length, length);
+		decoder.finish(buffer, length);
 	}
 
-	std::shared_ptr<byte> AwSocket::receivePackets(std::shared_ptr<boost::asio::ip::tcp::socket>& sock, uint32& length) {
-		std::shared_ptr<byte> buffer(new byte[PACKET_MAX_LENGTH]);
-		uint32 count = 0;
-		try {
-			count = sock->receive(boost::asio::buffer(buffer.get(), PACKET_MAX_LENGTH));
-			//count = boost::asio::read(*sock, boost::asio::buffer(buffer.get(), PACKET_MAX_LENGTH));
-			if (count == 0) {
-				length = 0;
-				return shared_ptr<byte>(new byte[0]);
-			}
-		}
-		catch (boost::system::system_error e) {
-			throw std::runtime_error("disconnect");
-		}
+	void AwSocket::sendElement(std::shared_ptr<Connection> conn, std::shared_ptr<ElementBase> element, uint32 requestId) {
+		// sizes first, then the whole frame is written into one buffer and sent from there
+		std::lock_guard<std::mutex> lock(conn->getWriteLock());
+		auto& buffer = conn->getWriteBuffer();
+		buffer.resize(element->encodedSize(conn->getFormat()));
+		byte* out = buffer.data();
+		element->encodeTo(conn->getFormat(), out);
+		sendMessage(conn, buffer.data(), buffer.size(), requestId);
+	}
 
-		AwSocket packet(buffer, 0, count);
-		while (!packet.isDone()) {
-			try {
-				uint32 thisCount = sock->receive(boost::asio::buffer(buffer.get(), PACKET_MAX_LENGTH));
-				packet.addPacket(buffer, 0, thisCount);
-			}
-			catch (boost::system::system_error e) {
-				throw std::runtime_error("disconnect");
+	std::shared_ptr<byte> AwSocket::receivePackets(std::shared_ptr<SocketType>& sock, uint32& length, uint32 maxLength, const ProgressFunc& progress) {
+		// Headers and slices are read with exact lengths: the stream may split
+		// or merge packets anywhere, and nothing past this message is consumed.
+		// Slices go straight to their place in the message buffer.
+		std::shared_ptr<byte> buffer;
+		uint32 position = 0, expected = 0;
+		for (bool first = true;; first = false) {
+			uint32 header[3];	// packets remaining, total length, slice length
+			sock->read(reinterpret_cast<byte*>(header), sizeof(header));
+			if (first) {
+				length = header[1];
+				if (length > maxLength)
+					throw std::runtime_error("message too large");
+				uint32 capacity = 0;
+				buffer = BufferPool::global().lease(length, capacity);
 			}
+			else if (header[0] != expected || header[1] != length)
+				throw std::runtime_error(__FUNCSIG__);
+			if (header[2] > length - position || header[2] > PACKET_MAX_LENGTH - sizeof(header))
+				throw std::overflow_error(__FUNCDNAME__);
+
+			sock->read(buffer.get() + position, header[2]);
+			position += header[2];
+			if (progress != nullptr && header[0] != 0)
+				progress(buffer.get(), position, length);
+			if (header[0] == 0)
+				break;
+			expected = header[0] - 1;
 		}
-		return packet.getPacketData(length);
+		if (position != length)
+			throw std::runtime_error(__FUNCSIG__);
+		return buffer;
 	}
-	void AwSocket::sendPackets(std::shared_ptr<boost::asio::ip::tcp::socket>& sock, std::shared_ptr<byte> data, uint32 offset, uint32 length) {
-		std::vector<AwSocket> ret;
+	void AwSocket::sendPackets(std::shared_ptr<SocketType>& sock, std::shared_ptr<byte> data, uint32 offset, uint32 length) {
+		sendPackets(sock, data.get() + offset, length);
+	}
+	void AwSocket::sendPackets(std::shared_ptr<SocketType>& sock, const byte* data, uint32 length) {
 		uint32 count = static_cast<int>(ceil((float)length / (PACKET_MAX_LENGTH - 3 * sizeof(uint32))));
 		uint32 restLength = length;
-		uint32 currentPosition = offset;
+		uint32 currentPosition = 0;
 		for (uint32 i = 0; i < count; ++i) {
 			uint32 dataSize = min(PACKET_MAX_LENGTH - 3 * sizeof(uint32), restLength);
-			uint32 packetSize = dataSize + 3 * sizeof(uint32);
-			std::shared_ptr<byte> packetData(new byte[packetSize]);
-
-			uint32 packOffset = 0;
-			writeUInt32AndMove(packetData, packOffset, count - i - 1);
-			writeUInt32AndMove(packetData, packOffset, length);
-			writeUInt32AndMove(packetData, packOffset, dataSize);
+			uint32 header[3] = { count - i - 1, length, dataSize };
 
-			memcpy(packetData.get() + packOffset, data.get() + currentPosition, dataSize);
-			
-			try {
-				sock->send(boost::asio::buffer(reinterpret_cast<char*>(packetData.get()), packetSize));
-			}
-			catch (boost::system::system_error e) {
-				throw std::runtime_error("disconnect");
-			}
+			// header and payload slice go out together, the payload is not copied
+			sock->write(reinterpret_cast<const byte*>(header), sizeof(header), data + currentPosition, dataSize);
 			
 			currentPosition += dataSize;
 			restLength -= dataSize;
 		}
 	}
+
+	byte* FrameReader::prepare(uint32& size) {
+		uint32 needed = pending();
+		if (needed - headerLength > limit)
+			throw std::runtime_error("message too large");
+		if (chunk != nullptr && begin == end) {
+			// nothing buffered, the chunk goes back to the pool when its frames are dropped
+			chunk = nullptr;
+			begin = end = 0;
+		}
+		if (chunk == nullptr || end == capacity || capacity - begin < needed) {
+			// a new chunk rather than compacting: earlier frames may still point into the old one
+			uint32 newCapacity = 0;
+			auto newChunk = BufferPool::global().lease(std::max(FRAME_BUFFER_LENGTH, needed), newCapacity);
+			if (end > begin)
+				memcpy(newChunk.get(), chunk.get() + begin, end - begin);
+			end -= begin;
+			begin = 0;
+			chunk = newChunk;
+			capacity = newCapacity;
+		}
+		size = capacity - end;
+		return chunk.get() + end;
+	}
+	uint32 FrameReader::pending() const {
+		if (end - begin < headerLength)
+			return headerLength;
+		uint32 offset = begin;
+		return headerLength + readFixed32(chunk.get(), end, offset);
+	}
+	std::shared_ptr<byte> FrameReader::next(uint32& length, uint32& requestId) {
+		if (end - begin < headerLength || end - begin < pending())
+			return nullptr;
+		uint32 offset = begin;
+		length = readFixed32(chunk.get(), end, offset);
+		requestId = headerLength == TAGGED_FRAME_HEADER_LENGTH ? readFixed32(chunk.get(), end, offset) : 0;
+		assert_format(length > 0);
+		if (length > limit)
+			throw std::runtime_error("message too large");
+		begin = offset + length;
+		// shares ownership of the chunk
+		return std::shared_ptr<byte>(chunk, chunk.get() + offset);
+	}
+
+	const byte* FrameReader::partial(uint32& received, uint32& length) const {
+		if (end - begin < headerLength)
+			return nullptr;
+		uint32 offset = begin;
+		length = readFixed32(chunk.get(), end, offset);
+		offset = begin + headerLength;
+		received = std::min(end - offset, length);
+		return chunk.get() + offset;
+	}
+
+	std::shared_ptr<byte> AwSocket::receiveFrame(std::shared_ptr<Connection> conn, uint32& length, uint32& requestId, const ProgressFunc& progress) {
+		auto& reader = conn->getReader();
+		for (;;) {
+			auto frame = reader.next(length, requestId);
+			if (frame != nullptr)
+				return frame;
+			uint32 size = 0;
+			byte* space = reader.prepare(size);
+			reader.commit(conn->getSocket()->readSome(space, size));
+
+			uint32 received = 0, total = 0;
+			const byte* data = reader.partial(received, total);
+			if (progress != nullptr && data != nullptr && received < total)
+				progress(data, received, total);
+		}
+	}
+	void AwSocket::sendFrame(std::shared_ptr<SocketType>& sock, const byte* data, uint32 length) {
+		byte header[FRAME_HEADER_LENGTH];
+		byte* out = header;
+		writeFixed32(out, length);
+		// one gathered write, however long the message
+		sock->write(header, sizeof(header), data, length);
+	}
+	void AwSocket::sendFrame(std::shared_ptr<SocketType>& sock, const byte* data, uint32 length, uint32 requestId) {
+		byte header[TAGGED_FRAME_HEADER_LENGTH];
+		byte* out = header;
+		writeFixed32(out, length);
+		writeFixed32(out, requestId);
+		sock->write(header, sizeof(header), data, length);
+	}
+
+	byte* PacketReader::prepare(uint32& size) {
+		// the part of a packet that is left moves to the front, a whole packet always fits
+		if (begin > 0) {
+			memmove(input.data(), input.data() + begin, end - begin);
+			end -= begin;
+			begin = 0;
+		}
+		if (input.size() < FRAME_BUFFER_LENGTH)
+			input.resize(FRAME_BUFFER_LENGTH);
+		size = input.size() - end;
+		return input.data() + end;
+	}
+	std::shared_ptr<byte> PacketReader::next(uint32& length) {
+		// the same checks as receivePackets, a packet is only taken once all of it is here
+		const uint32 headerLength = 3 * sizeof(uint32);
+		while (end - begin >= headerLength) {
+			uint32 header[3];	// packets remaining, total length, slice length
+			memcpy(header, input.data() + begin, headerLength);
+			bool first = message == nullptr;
+			if (first && header[1] > limit)
+				throw std::runtime_error("message too large");
+			if (!first && (header[0] != expected || header[1] != this->length))
+				throw std::runtime_error(__FUNCSIG__);
+			if (header[2] > header[1] - (first ? 0 : position) || header[2] > PACKET_MAX_LENGTH - headerLength)
+				throw std::overflow_error(__FUNCDNAME__);
+			if (end - begin - headerLength < header[2])
+				return nullptr;
+
+			if (first) {
+				uint32 capacity = 0;
+				message = BufferPool::global().lease(header[1], capacity);
+				this->length = header[1];
+				position = 0;
+			}
+			memcpy(message.get() + position, input.data() + begin + headerLength, header[2]);
+			position += header[2];
+			begin += headerLength + header[2];
+			if (header[0] == 0) {
+				if (position != this->length)
+					throw std::runtime_error(__FUNCSIG__);
+				length = this->length;
+				auto ret = message;
+				message = nullptr;
+				return ret;
+			}
+			expected = header[0] - 1;
+		}
+		return nullptr;
+	}
+
+	// a session moves to frames after the handshake, bytes that came along move with it
+	static void carryOver(Connection& conn) {
+		uint32 size = 0;
+		const byte* left = conn.getPacketReader().buffered(size);
+		while (size > 0) {
+			uint32 space = 0;
+			byte* p = conn.getReader().prepare(space);
+			uint32 n = min(space, size);
+			memcpy(p, left, n);
+			conn.getReader().commit(n);
+			left += n;
+			size -= n;
+		}
+		conn.getPacketReader().clear();
+	}
+	byte* AwSocket::prepareRead(std::shared_ptr<Connection> conn, uint32& size) {
+		if (conn->getFeatures() & FeatureFraming) {
+			carryOver(*conn);
+			return conn->getReader().prepare(size);
+		}
+		return conn->getPacketReader().prepare(size);
+	}
+	void AwSocket::commitRead(std::shared_ptr<Connection> conn, uint32 count) {
+		if (conn->getFeatures() & FeatureFraming)
+			conn->getReader().commit(count);
+		else
+			conn->getPacketReader().commit(count);
+	}
+	std::shared_ptr<byte> AwSocket::nextMessage(std::shared_ptr<Connection> conn, uint32& length, uint32& requestId) {
+		std::shared_ptr<byte> buffer;
+		requestId = 0;
+		if (conn->getFeatures() & FeatureFraming) {
+			carryOver(*conn);
+			buffer = conn->getReader().next(length, requestId);
+		}
+		else
+			buffer = conn->getPacketReader().next(length);
+		if (buffer == nullptr)
+			return nullptr;
+		if (length == 0)
+			throw std::runtime_error("disconnect");
+#ifdef __AW_ZLIB__
+		if ((conn->getFeatures() & FeatureCompression) && buffer.get()[0] == COMPRESSED_MARKER)
+			return decompressMessage(buffer.get(), length, conn->getMaxMessageLength());
+#endif
+		return buffer;
+	}
 }
\ No newline at end of file
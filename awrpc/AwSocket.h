@@ -3,37 +3,488 @@
 
 #include "ArchDeps.h"
 #include "Elements.h"
+#include "FlatElements.h"
+#include "BufferPool.h"
 #include <boost/asio.hpp>
 #include <memory>	// shared_ptr
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <array>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 #include <cmath>
 
 namespace AW {
-	typedef boost::asio::ip::tcp::socket SocketType;
+	//////////////////////////////////////////////////////////////////////////
+	// Stream transports
+	// Everything above this talks to a SocketType. Transports throw
+	// std::runtime_error("disconnect") when the stream is gone.
+	//////////////////////////////////////////////////////////////////////////
+	class SocketType {
+	public:
+		virtual ~SocketType() { }
+		// some bytes, at least one
+		virtual uint32 readSome(byte* data, uint32 length) = 0;
+		// a header and a payload, in one write where the transport can
+		virtual void write(const byte* header, uint32 headerLength, const byte* data, uint32 length) = 0;
+		virtual void close() = 0;
+		// Starts reading some bytes into data and returns; done gets the count,
+		// 0 once the stream is gone. False for transports that can only block.
+		virtual bool readSomeAsync(byte*, uint32, std::function<void(uint32)>) { return false; }
+
+		// exactly length bytes
+		void read(byte* data, uint32 length) {
+			for (uint32 done = 0; done < length;)
+				done += readSome(data + done, length - done);
+		}
+	};
+
+	// A TCP or local (Unix domain) stream socket
+	// In the background mode of pooled sessions writes are queued and sent by
+	// the io_service threads, the caller never waits for the peer. Socket
+	// operations are started on a strand, so the pool threads never race on them.
+	template<typename Protocol>
+	class AsioSocket :public SocketType, public std::enable_shared_from_this<AsioSocket<Protocol>> {
+	public:
+		// the socket keeps its io_service alive
+		explicit AsioSocket(std::shared_ptr<boost::asio::io_service> service)
+			:service(service), socket(*service), strand(*service), background(false), writing(false), closing(false), failed(false) { }
+
+		typename Protocol::socket& get() { return socket; }
+		// before the session starts, from then on writes do not block
+		void setBackground(bool enabled) { background = enabled; }
+
+		virtual uint32 readSome(byte* data, uint32 length) override {
+			try {
+				return socket.read_some(boost::asio::buffer(data, length));
+			}
+			catch (const boost::system::system_error& e) {
+				throw std::runtime_error("disconnect");
+			}
+		}
+		virtual void write(const byte* header, uint32 headerLength, const byte* data, uint32 length) override {
+			if (background) {
+				queueWrite(header, headerLength, data, length);
+				return;
+			}
+			std::array<boost::asio::const_buffer, 2> buffers = {
+				boost::asio::buffer(header, headerLength),
+				boost::asio::buffer(data, length)
+			};
+			try {
+				boost::asio::write(socket, buffers);
+			}
+			catch (const boost::system::system_error& e) {
+				throw std::runtime_error("disconnect");
+			}
+		}
+		virtual void close() override {
+			if (!background) {
+				closeNow();
+				return;
+			}
+			// after the queued writes
+			auto self = this->shared_from_this();
+			strand.dispatch([self]() {
+				std::lock_guard<std::mutex> lock(self->writeLock);
+				self->closing = true;
+				if (!self->writing)
+					self->closeNow();
+			});
+		}
+		virtual bool readSomeAsync(byte* data, uint32 length, std::function<void(uint32)> done) override {
+			auto self = this->shared_from_this();
+			strand.dispatch([self, data, length, done]() {
+				self->socket.async_read_some(boost::asio::buffer(data, length), [done](const boost::system::error_code& ec, std::size_t n) {
+					done(ec ? 0 : static_cast<uint32>(n));
+				});
+			});
+			return true;
+		}
+	private:
+		struct PendingWrite {
+			std::shared_ptr<byte> data;
+			uint32 length;
+		};
+
+		void queueWrite(const byte* header, uint32 headerLength, const byte* data, uint32 length) {
+			uint32 capacity = 0;
+			PendingWrite w = { BufferPool::global().lease(headerLength + length, capacity), headerLength + length };
+			memcpy(w.data.get(), header, headerLength);
+			memcpy(w.data.get() + headerLength, data, length);
+
+			std::lock_guard<std::mutex> lock(writeLock);
+			if (failed || closing)
+				throw std::runtime_error("disconnect");
+			queue.push_back(w);
+			if (!writing) {
+				writing = true;
+				auto self = this->shared_from_this();
+				strand.post([self]() { self->writeNext(); });
+			}
+		}
+		// on the strand, one write in flight at a time
+		void writeNext() {
+			PendingWrite w;
+			{
+				std::lock_guard<std::mutex> lock(writeLock);
+				w = queue.front();
+			}
+			auto self = this->shared_from_this();
+			boost::asio::async_write(socket, boost::asio::buffer(w.data.get(), w.length), strand.wrap([self](const boost::system::error_code& ec, std::size_t) {
+				std::unique_lock<std::mutex> lock(self->writeLock);
+				self->queue.pop_front();
+				if (ec) {
+					self->failed = true;
+					self->queue.clear();
+				}
+				if (self->queue.empty()) {
+					self->writing = false;
+					if (self->closing)
+						self->closeNow();
+					return;
+				}
+				lock.unlock();
+				self->writeNext();
+			}));
+		}
+		void closeNow() {
+			boost::system::error_code ignored;
+			socket.close(ignored);
+		}
+
+		std::shared_ptr<boost::asio::io_service> service;
+		typename Protocol::socket socket;
+		boost::asio::io_service::strand strand;
+		bool background;
+		std::mutex writeLock;
+		std::deque<PendingWrite> queue;
+		bool writing;
+		bool closing;
+		bool failed;
+	};
+	typedef AsioSocket<boost::asio::ip::tcp> TcpSocket;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	typedef AsioSocket<boost::asio::local::stream_protocol> LocalSocket;
+#endif
 
 	inline uint32 min(uint32 a, uint32 b) {
 		return a > b ? b : a;
 	}
 
-	class AwSocket {
+	//////////////////////////////////////////////////////////////////////////
+	// Per connection options, agreed on at handshake
+	//////////////////////////////////////////////////////////////////////////
+	enum ConnectionFeature : uint32 {
+		FeatureBinary = 1 << 0,
+		FeatureCompression = 1 << 1,
+		FeatureInterning = 1 << 2,	// binary messages may carry a string table
+		FeatureFraming = 1 << 3,	// one length header per message instead of packets
+		FeatureSharedMemory = 1 << 4,	// local sessions only, see ShmSocket.h
+		FeatureMethodIds = 1 << 5,	// calls may name their method by its number in the server's table
+		FeatureRequestIds = 1 << 6,	// frames carry a request ID, replies may come in any order; needs FeatureFraming
+	};
+	// features this build can speak, advertised after the port number in the handshake
+#ifdef __AW_ZLIB__
+	constexpr uint32 SUPPORTED_FEATURES = FeatureBinary | FeatureCompression | FeatureInterning | FeatureFraming | FeatureMethodIds | FeatureRequestIds;
+#else
+	constexpr uint32 SUPPORTED_FEATURES = FeatureBinary | FeatureInterning | FeatureFraming | FeatureMethodIds | FeatureRequestIds;
+#endif
+	// local sessions may also move to shared memory
+#ifdef __AW_SHM__
+	constexpr uint32 LOCAL_FEATURES = SUPPORTED_FEATURES | FeatureSharedMemory;
+#else
+	constexpr uint32 LOCAL_FEATURES = SUPPORTED_FEATURES;
+#endif
+	// First byte of a compressed message, followed by the varint original length
+	// and the zlib stream. Neither wire format starts with it.
+	constexpr byte COMPRESSED_MARKER = 0xC0;
+
+	//////////////////////////////////////////////////////////////////////////
+	// Framing
+	// A framed message is a fixed32 payload length and the payload. With
+	// FeatureRequestIds a fixed32 request ID follows the length: a reply has
+	// the ID of its call, so calls of one connection may overlap.
+	// FrameReader cuts frames out of whatever the socket delivered and does no
+	// IO itself. Frames point into the chunk they were read into, so several
+	// frames from one read are handed out without copies.
+	//////////////////////////////////////////////////////////////////////////
+	constexpr uint32 FRAME_HEADER_LENGTH = 4;
+	constexpr uint32 TAGGED_FRAME_HEADER_LENGTH = 8;
+
+	// sees the first received bytes of a message whenever more have come in
+	typedef std::function<void(const byte* data, uint32 received, uint32 length)> ProgressFunc;
+
+	class FrameReader {
+	public:
+		FrameReader() :capacity(0), begin(0), end(0), limit(DEFAULT_MAX_MESSAGE_LENGTH), headerLength(FRAME_HEADER_LENGTH) { }
+
+		// longer frames throw before they are buffered
+		void setLimit(uint32 limit) { this->limit = limit; }
+		// frames from now on carry a request ID
+		void setTagged(bool tagged) { headerLength = tagged ? TAGGED_FRAME_HEADER_LENGTH : FRAME_HEADER_LENGTH; }
+		// free space for the next read, large enough for the frame being read
+		byte* prepare(uint32& size);
+		void commit(uint32 count) { end += count; }
+		// the next whole frame, nullptr until it has arrived; requestId is 0
+		// for untagged frames
+		std::shared_ptr<byte> next(uint32& length, uint32& requestId);
+		// the start of the frame still arriving, nullptr until its header has
+		const byte* partial(uint32& received, uint32& length) const;
+	private:
+		// bytes the frame at begin needs, header included, as far as known
+		uint32 pending() const;
+
+		std::shared_ptr<byte> chunk;
+		uint32 capacity;
+		uint32 begin;	// first unread byte
+		uint32 end;		// end of the received bytes
+		uint32 limit;
+		uint32 headerLength;
+	};
+
+	// Cuts messages in the packet format out of whatever the socket delivered,
+	// for readers that cannot block on exact lengths. Slices are copied from
+	// the read buffer to their place in the message.
+	class PacketReader {
 	public:
-		static AW::string receiveString(std::shared_ptr<boost::asio::ip::tcp::socket>& sock);
-		static void sendString(std::shared_ptr<boost::asio::ip::tcp::socket> sock, const AW::string& str);
+		PacketReader() :begin(0), end(0), length(0), position(0), expected(0), limit(DEFAULT_MAX_MESSAGE_LENGTH) { }
 
-		static std::shared_ptr<byte> receivePackets(std::shared_ptr<boost::asio::ip::tcp::socket>& sock, uint32& length);
-		static void sendPackets(std::shared_ptr<boost::asio::ip::tcp::socket>& sock, std::shared_ptr<byte> data, uint32 offset, uint32 length);
+		void setLimit(uint32 limit) { this->limit = limit; }
+		// free space for the next read
+		byte* prepare(uint32& size);
+		void commit(uint32 count) { end += count; }
+		// the next whole message, nullptr until it has arrived
+		std::shared_ptr<byte> next(uint32& length);
+		// received bytes no message has taken yet
+		const byte* buffered(uint32& size) const {
+			size = end - begin;
+			return input.data() + begin;
+		}
+		void clear() { begin = end = 0; }
 	private:
-		AwSocket(std::shared_ptr<byte> firstPacket, uint32 offset, uint32 length);
-		AwSocket(uint32 packetsRemaining, uint32 totalLength, std::shared_ptr<byte> data, uint32 length);
-		void addPacket(std::shared_ptr<byte> data, uint32 offset, uint32 length);
-		bool isDone() const;
-		std::shared_ptr<byte> getPacketData(uint32& length) const;
-		std::shared_ptr<byte> toByteArray(uint32& length) const;
+		ByteBuffer input;
+		uint32 begin;		// first unread byte of input
+		uint32 end;
+		std::shared_ptr<byte> message;	// being put together
+		uint32 length;
+		uint32 position;
+		uint32 expected;	// packets remaining after the next one
+		uint32 limit;
+	};
+
+	class Connection {
+	public:
+		explicit Connection(std::shared_ptr<SocketType> socket, uint32 features = 0)
+			:socket(socket), features(0), offered(SUPPORTED_FEATURES), maxMessageLength(DEFAULT_MAX_MESSAGE_LENGTH), chunksSent(0), chunksAcked(0), cancelled(false), streams(0), lastRequestId(0), replyReading(false) {
+			setFeatures(features);
+		}
+
+		std::shared_ptr<SocketType>& getSocket() { return socket; }
+		// another transport for the same session, swapped in at handshake
+		void setSocket(std::shared_ptr<SocketType> socket) { this->socket = socket; }
+		uint32 getFeatures() const { return features; }
+		void setFeatures(uint32 features) {
+			this->features = features;
+			reader.setTagged((features & FeatureRequestIds) != 0);
+		}
+		// what the server advertised to this peer
+		uint32 getOfferedFeatures() const { return offered; }
+		void setOfferedFeatures(uint32 offered) { this->offered = offered; }
+		WireFormat getFormat() const { return (features & FeatureBinary) ? WireFormat::Binary : WireFormat::Text; }
+		// longest message accepted from the peer, however it is framed or compressed
+		uint32 getMaxMessageLength() const { return maxMessageLength; }
+		void setMaxMessageLength(uint32 length) {
+			maxMessageLength = length;
+			reader.setLimit(length);
+			packets.setLimit(length);
+		}
+		// reused for every reply on this connection
+		FlatDocument& getDocument() { return document; }
+		FrameReader& getReader() { return reader; }
+		PacketReader& getPacketReader() { return packets; }
+		PushDecoder& getDecoder() { return decoder; }
+		// encoders write outgoing messages here while holding the write lock
+		ByteBuffer& getWriteBuffer() { return writeBuffer; }
+		std::mutex& getWriteLock() { return writeLock; }
+		// a document no earlier request still reads, called from the receiving thread
+		std::shared_ptr<FlatDocument> leaseDocument() {
+			for (auto& d : documents) {
+				if (d.use_count() == 1) {
+					std::atomic_thread_fence(std::memory_order_acquire);
+					return d;
+				}
+			}
+			documents.push_back(std::shared_ptr<FlatDocument>(new FlatDocument));
+			return documents.back();
+		}
+
+		// Flow control of streamed replies (Stream.h). The counts run over the
+		// whole connection, so acknowledgements that arrive after a stream
+		// ended still line up with the chunks they are for.
+		void grantCredit(uint32 chunks) {
+			std::lock_guard<std::mutex> lock(creditLock);
+			chunksAcked += chunks;
+			creditAdded.notify_all();
+		}
+		// waits until another chunk fits in the window
+		void takeCredit() {
+			std::unique_lock<std::mutex> lock(creditLock);
+			creditAdded.wait(lock, [this]() { return chunksSent - chunksAcked < STREAM_WINDOW || cancelled; });
+			if (cancelled)
+				throw std::runtime_error("disconnect");
+			chunksSent++;
+		}
+		// the session is over, streams stop waiting
+		void cancelCredit() {
+			std::lock_guard<std::mutex> lock(creditLock);
+			cancelled = true;
+			creditAdded.notify_all();
+		}
+		// a stream handler starts, false when MAX_STREAMS_PER_CONNECTION are running
+		bool startStream() {
+			std::lock_guard<std::mutex> lock(creditLock);
+			if (streams == MAX_STREAMS_PER_CONNECTION)
+				return false;
+			streams++;
+			return true;
+		}
+		void endStream() {
+			std::lock_guard<std::mutex> lock(creditLock);
+			streams--;
+		}
+
+		// the server's method names in ID order, set once at handshake
+		void setMethodIds(const std::vector<AW::string>& names) {
+			methodIds.clear();
+			for (uint32 i = 0; i < names.size(); ++i)
+				methodIds.emplace(names[i], i);
+		}
+		bool findMethodId(const AW::string& name, uint32& id) const {
+			auto it = methodIds.find(name);
+			if (it == methodIds.end())
+				return false;
+			id = it->second;
+			return true;
+		}
+		// the ID of a new call, 0 when replies come in order anyway
+		uint32 nextRequestId() {
+			return (features & FeatureRequestIds) ? ++lastRequestId : 0;
+		}
+		// Replies to requestId are wanted from now on, until forgetReply. One
+		// read for an ID nobody waits for is dropped, not kept by receiveReply.
+		void expectReply(uint32 requestId) {
+			if (requestId == 0)
+				return;
+			std::lock_guard<std::mutex> lock(replyLock);
+			expected.insert(requestId);
+		}
+		void forgetReply(uint32 requestId) {
+			if (requestId == 0)
+				return;
+			std::lock_guard<std::mutex> lock(replyLock);
+			expected.erase(requestId);
+			replies.erase(requestId);
+		}
+		// replies read for other callers that they have not taken yet
+		uint32 getKeptReplies() {
+			std::lock_guard<std::mutex> lock(replyLock);
+			uint32 ret = 0;
+			for (auto& r : replies)
+				ret += r.second.size();
+			return ret;
+		}
 	private:
-		uint32 packetsRemaining;
-		uint32 totalLength;
-		std::shared_ptr<byte> buffer;
-		uint32 bufferLength;
-		uint32 currentPosition;
+		friend class AwSocket;
+
+		std::shared_ptr<SocketType> socket;
+		uint32 features;
+		uint32 offered;
+		uint32 maxMessageLength;
+		FlatDocument document;
+		FrameReader reader;
+		PacketReader packets;
+		PushDecoder decoder;
+		std::vector<std::shared_ptr<FlatDocument>> documents;
+		ByteBuffer writeBuffer;
+		std::mutex writeLock;
+		// used by sendMessage under sendLock
+		std::mutex sendLock;
+		ByteBuffer interned;
+		ByteBuffer compressed;
+		std::mutex creditLock;
+		std::condition_variable creditAdded;
+		uint64 chunksSent;
+		uint64 chunksAcked;
+		bool cancelled;
+		uint32 streams;
+		std::unordered_map<AW::string, uint32> methodIds;
+		std::atomic<uint32> lastRequestId;
+		// replies read by one caller for another, see receiveReply
+		std::mutex replyLock;
+		std::condition_variable replyArrived;
+		bool replyReading;
+		std::unordered_map<uint32, std::deque<std::pair<std::shared_ptr<byte>, uint32>>> replies;
+		std::unordered_set<uint32> expected;
+	};
+
+	// Forgets a call's reply when it goes out of scope, however the caller
+	// leaves, so that the rest of it is dropped when it comes
+	class ReplyWait {
+	public:
+		ReplyWait(std::shared_ptr<Connection> conn, uint32 requestId) :conn(conn), requestId(requestId) { }
+		~ReplyWait() { conn->forgetReply(requestId); }
+		ReplyWait(const ReplyWait&) = delete;
+		ReplyWait& operator=(const ReplyWait&) = delete;
+	private:
+		std::shared_ptr<Connection> conn;
+		uint32 requestId;
+	};
+
+	class AwSocket {
+	public:
+		static AW::string receiveString(std::shared_ptr<SocketType> sock);
+		static void sendString(std::shared_ptr<SocketType> sock, const AW::string& str);
+
+		// encode in the connection's wire format, decode whichever format arrives
+		static std::shared_ptr<ElementBase> receiveElement(std::shared_ptr<Connection> conn);
+		static void sendElement(std::shared_ptr<Connection> conn, std::shared_ptr<ElementBase> element, uint32 requestId = 0);
+		static void receiveDocument(std::shared_ptr<Connection> conn, FlatDocument& doc, bool lazy = false);
+		static void receiveDocument(std::shared_ptr<Connection> conn, FlatDocument& doc, bool lazy, uint32& requestId);
+		// one whole message, throws when the peer is gone
+		static std::shared_ptr<byte> receiveMessage(std::shared_ptr<Connection> conn, uint32& length, const ProgressFunc& progress = nullptr);
+		static std::shared_ptr<byte> receiveMessage(std::shared_ptr<Connection> conn, uint32& length, uint32& requestId, const ProgressFunc& progress = nullptr);
+		// the answer to the call requestId, also throws the message of an error
+		// reply. Callers on other threads may wait for their own replies at the
+		// same time: one of them reads and keeps what is not its own for the
+		// others whose calls are expected (Connection::expectReply).
+		static std::shared_ptr<byte> receiveReply(std::shared_ptr<Connection> conn, uint32& length, uint32 requestId = 0);
+		// requestId is only sent on connections with FeatureRequestIds
+		static void sendMessage(std::shared_ptr<Connection> conn, const byte* data, uint32 length, uint32 requestId = 0);
+		// A message interned and compressed the way sendMessage would for
+		// conn, and connections with the same features, to be sent any number
+		// of times with sendPacked
+		static void packMessage(std::shared_ptr<Connection> conn, const byte* data, uint32 length, ByteBuffer& packed);
+		static void sendPacked(std::shared_ptr<Connection> conn, const byte* data, uint32 length, uint32 requestId = 0);
+
+		// the packet format, spoken before the handshake and with old peers
+		static std::shared_ptr<byte> receivePackets(std::shared_ptr<SocketType>& sock, uint32& length, uint32 maxLength = DEFAULT_MAX_MESSAGE_LENGTH, const ProgressFunc& progress = nullptr);
+		static void sendPackets(std::shared_ptr<SocketType>& sock, std::shared_ptr<byte> data, uint32 offset, uint32 length);
+		static void sendPackets(std::shared_ptr<SocketType>& sock, const byte* data, uint32 length);
+
+		static std::shared_ptr<byte> receiveFrame(std::shared_ptr<Connection> conn, uint32& length, uint32& requestId, const ProgressFunc& progress = nullptr);
+
+		// The same without blocking, for sessions that read in the background:
+		// the bytes of a read go to prepareRead's space, then nextMessage hands
+		// out the messages they completed until it returns nullptr.
+		static byte* prepareRead(std::shared_ptr<Connection> conn, uint32& size);
+		static void commitRead(std::shared_ptr<Connection> conn, uint32 count);
+		static std::shared_ptr<byte> nextMessage(std::shared_ptr<Connection> conn, uint32& length, uint32& requestId);
+		static void sendFrame(std::shared_ptr<SocketType>& sock, const byte* data, uint32 length);
+		static void sendFrame(std::shared_ptr<SocketType>& sock, const byte* data, uint32 length, uint32 requestId);
 	};
 };
 
@@ -0,0 +1,61 @@
+#ifndef __AW_BUFFER_POOL_H__
+#define __AW_BUFFER_POOL_H__
+
+#include "ArchDeps.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Buffer pool
+	// Byte blocks in power of two size classes, shared by all connections.
+	// A lease is a copy of a pooled shared_ptr, so a block is free again as
+	// soon as the last copy outside the pool is dropped; nothing is returned
+	// by hand and leasing a free block allocates nothing.
+	//////////////////////////////////////////////////////////////////////////
+	constexpr uint32 POOL_MIN_BLOCK = 256;
+	constexpr uint32 POOL_CLASS_COUNT = 15;		// up to 4 MiB, larger blocks are not pooled
+	constexpr uint32 POOL_BLOCKS_PER_CLASS = 16;
+
+	class BufferPool {
+	public:
+		static BufferPool& global() {
+			static BufferPool pool;
+			return pool;
+		}
+
+		// a block of at least size bytes, capacity is its real size
+		std::shared_ptr<byte> lease(uint32 size, uint32& capacity) {
+			uint32 sizeClass = 0;
+			while (sizeClass < POOL_CLASS_COUNT && (POOL_MIN_BLOCK << sizeClass) < size)
+				sizeClass++;
+			if (sizeClass == POOL_CLASS_COUNT) {
+				capacity = size;
+				return std::shared_ptr<byte>(new byte[size], std::default_delete<byte[]>());
+			}
+			capacity = POOL_MIN_BLOCK << sizeClass;
+
+			// only the pool copies pooled pointers, so a block seen free here stays free
+			std::lock_guard<std::mutex> lock(mu);
+			auto& blocks = classes[sizeClass];
+			for (auto& b : blocks) {
+				if (b.use_count() == 1) {
+					// see everything its last user wrote
+					std::atomic_thread_fence(std::memory_order_acquire);
+					return b;
+				}
+			}
+			std::shared_ptr<byte> b(new byte[capacity], std::default_delete<byte[]>());
+			if (blocks.size() < POOL_BLOCKS_PER_CLASS)
+				blocks.push_back(b);
+			return b;
+		}
+	private:
+		std::mutex mu;
+		std::vector<std::shared_ptr<byte>> classes[POOL_CLASS_COUNT];
+	};
+}
+
+#endif
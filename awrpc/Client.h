@@ -4,6 +4,7 @@
 #include "ArchDeps.h"
 #include "Elements.h"
 #include "AwSocket.h"
+#include "Codec.h"
 #include <boost/asio.hpp>
 #include <iostream>
 #include <string>
@@ -12,6 +13,45 @@
 #include <memory>
 
 namespace AW {
+	// Encodes a call straight into the connection's write buffer and sends it.
+	// The method goes by its ID when the server gave one. Returns the request
+	// ID its reply comes with, expected until the caller forgets it (ReplyWait).
+	template<typename...ArgsT>
+	AW::uint32 sendCall(std::shared_ptr<Connection> conn, const AW::string& name, const ArgsT&... args) {
+		auto format = conn->getFormat();
+		AW::uint32 id = 0;
+		bool byId = conn->findMethodId(name, id);
+		static thread_local CodecSizes sizes;
+		sizes.clear();
+		AW::uint32 payload = (byId ? Codec<AW::uint32>::size(format, id) : Codec<AW::string>::size(format, name)) + tupleSize(format, sizes, args...);
+		std::lock_guard<std::mutex> lock(conn->getWriteLock());
+		auto& frame = conn->getWriteBuffer();
+		frame.resize(headerSize(format, payload) + payload);
+		AW::byte* out = frame.data();
+		writeHeader(format, out, TupleTypeName, BinaryTag::Tuple, payload);
+		if (byId)
+			Codec<AW::uint32>::encode(format, out, id);
+		else
+			Codec<AW::string>::encode(format, out, name);
+		encodeTuple(format, out, sizes, args...);
+		AW::uint32 requestId = conn->nextRequestId();
+		// before it goes out, the reply may come before sendMessage returns
+		conn->expectReply(requestId);
+		try {
+			AwSocket::sendMessage(conn, frame.data(), frame.size(), requestId);
+		}
+		catch (...) {
+			conn->forgetReply(requestId);
+			throw;
+		}
+		return requestId;
+	}
+	// a call that is not answered, like __CREDIT
+	template<typename...ArgsT>
+	void sendNotice(std::shared_ptr<Connection> conn, const AW::string& name, const ArgsT&... args) {
+		conn->forgetReply(sendCall(conn, name, args...));
+	}
+
 	//////////////////////////////////////////////////////////////////////////
 	// Return value specializations
 	//////////////////////////////////////////////////////////////////////////
@@ -20,33 +60,69 @@ namespace AW {
 	template <typename RetValT>
 	class ClientRetBase {
 	public:
-		ClientRetBase(std::shared_ptr<SocketType> sock, const AW::string& name) :sock(sock), name(name) {}
+		ClientRetBase(std::shared_ptr<Connection> conn, const AW::string& name) :conn(conn), name(name) {}
+		ClientRetBase(std::shared_ptr<SocketType> sock, const AW::string& name) :conn(new Connection(sock)), name(name) {}
 		ClientRetBase() {}
 		virtual RetValT operator()(std::shared_ptr<ElementBase> params) {
 			return process(params);
 		}
 		RetValT process(std::shared_ptr<ElementBase> params) {
-			auto pack = packFunctionTuple(params);
-			std::basic_stringstream<AW::character> ss;
-			sendAndReceive(sock, pack, ss);
-			auto r = fromString(ss);
-			return parse(r);
+			AW::uint32 requestId = conn->nextRequestId();
+			conn->expectReply(requestId);
+			ReplyWait wait(conn, requestId);
+			AwSocket::sendElement(conn, packFunction(params), requestId);
+			if (conn->getFeatures() & FeatureRequestIds) {
+				// other calls may be in flight, the reply is found by its ID
+				AW::uint32 length = 0;
+				auto reply = AwSocket::receiveReply(conn, length, requestId);
+				FlatDocument doc;
+				doc.parse(reply, length);
+				return parse(doc.root());
+			}
+			// the reply is decoded while it arrives
+			auto& doc = conn->getDocument();
+			AwSocket::receiveDocument(conn, doc);
+			throwIfError(doc.getBuffer().get(), doc.getLength());
+			return parse(doc.root());
+		}
+		// Typed call: arguments are encoded straight into the frame and the reply
+		// is decoded straight into RetValT, no element tree on either side
+		template<typename...ArgsT>
+		RetValT call(const ArgsT&... args) {
+			AW::uint32 requestId = sendCall(conn, name, args...);
+			ReplyWait wait(conn, requestId);
+
+			AW::uint32 length = 0;
+			auto reply = AwSocket::receiveReply(conn, length, requestId);
+			auto replyFormat = detectFormat(reply.get());
+			AW::uint32 offset = messageBodyOffset(replyFormat, reply.get(), length);
+			auto ret = Codec<RetValT>::decode(replyFormat, reply.get(), length, offset);
+			assert_format(offset == length);
+			return ret;
 		}
 		virtual RetValT parse(std::shared_ptr<ElementBase> params) = 0;
+		virtual RetValT parse(const FlatCursor& ret) = 0;
 
 		AW::string getName() const { return name; }
-		AW::string packFunctionTuple(std::shared_ptr<ElementBase> params) {
+		std::shared_ptr<TupleType> packFunction(std::shared_ptr<ElementBase> params) {
 			std::shared_ptr<TupleType> ps(new TupleType);
-			ps->add(std::shared_ptr<Element<AW::string>>(new Element<AW::string>(name)));
+			AW::uint32 id = 0;
+			if (conn != nullptr && conn->findMethodId(name, id))
+				ps->add(std::shared_ptr<Element<AW::uint32>>(new Element<AW::uint32>(id)));
+			else
+				ps->add(std::shared_ptr<Element<AW::string>>(new Element<AW::string>(name)));
 			ps->add(params);
-			return ps->toString();
+			return ps;
+		}
+		AW::string packFunctionTuple(std::shared_ptr<ElementBase> params) {
+			return packFunction(params)->toString();
 		}
-		static void sendAndReceive(std::shared_ptr<boost::asio::ip::tcp::socket> sock, const AW::string& str, std::basic_stringstream<AW::character>& ss) {
+		static void sendAndReceive(std::shared_ptr<SocketType> sock, const AW::string& str, std::basic_stringstream<AW::character>& ss) {
 			AwSocket::sendString(sock, str);
 			ss << AwSocket::receiveString(sock);
 		}
 	protected:
-		std::shared_ptr<SocketType> sock;
+		std::shared_ptr<Connection> conn;
 		AW::string name;
 	};
 
@@ -59,6 +135,9 @@ namespace AW {
 			auto r = ret;
 			return dynamic_cast<Element<RetValT>*>(r.get())->getValue();
 		}
+		virtual RetValT parse(const FlatCursor& ret) override {
+			return ret.as<RetValT>();
+		}
 	};
 
 	// ClientRet template specialization (for map, vector)
@@ -69,11 +148,22 @@ namespace AW {
 		using ClientRetBase<std::vector<ElementT>>::ClientRetBase;
 		virtual std::vector<ElementT> parse(std::shared_ptr<ElementBase> retEle) override {
 			std::vector<ElementT> ret;
+			if (readPackedElement(retEle, ret))
+				return ret;
 			dynamic_cast<TupleType*>(retEle.get())->for_each_const([&ret](std::shared_ptr<AW::ElementBase> element) -> void {
 				ret.push_back(ClientRet<ElementT>().parse(element));
 			});
 			return ret;
 		}
+		virtual std::vector<ElementT> parse(const FlatCursor& retEle) override {
+			std::vector<ElementT> ret;
+			if (retEle.readPackedArray(ret))
+				return ret;
+			ret.reserve(retEle.size());
+			for (AW::uint32 i = 0; i < retEle.size(); ++i)
+				ret.push_back(ClientRet<ElementT>().parse(retEle[i]));
+			return ret;
+		}
 	};
 
 	// map
@@ -88,6 +178,12 @@ namespace AW {
 			});
 			return ret;
 		}
+		virtual std::map<KeyT, ValT> parse(const FlatCursor& retEle) override {
+			std::map<KeyT, ValT> ret;
+			for (AW::uint32 i = 0; i < retEle.size(); ++i)
+				ret[ClientRet<KeyT>().parse(retEle.key(i))] = ClientRet<ValT>().parse(retEle.value(i));
+			return ret;
+		}
 	};
 
 	//////////////////////////////////////////////////////////////////////////
@@ -99,7 +195,7 @@ namespace AW {
 		using ClientRet<RetValT>::ClientRet;
 
 		virtual RetValT operator()(FirstArgT t) {
-			return operator()(std::shared_ptr<TupleType>(new TupleType), t);
+			return ClientRetBase<RetValT>::call(t);
 		}
 		virtual RetValT operator()(std::shared_ptr<TupleType> params, FirstArgT t) {
 			parse(params, t);
@@ -120,7 +216,7 @@ namespace AW {
 	public:
 		using Client<RetValT, ArgsT...>::Client;
 		RetValT operator()(FirstArgT t, ArgsT... args) {
-			return operator()(std::shared_ptr<TupleType>(new TupleType), t, args...);
+			return ClientRetBase<RetValT>::call(t, args...);
 		}
 	private:
 		RetValT operator()(std::shared_ptr<TupleType> params, FirstArgT t, ArgsT... args) {
@@ -0,0 +1,286 @@
+#ifndef __AW_CODEC_H__
+#define __AW_CODEC_H__
+
+#include "ArchDeps.h"
+#include "Elements.h"
+#include <vector>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Typed codecs
+	// Encode C++ values straight to wire bytes and back, in the same formats
+	// as the element classes, without building an ElementBase tree.
+	//   size:   encoded bytes of v, header included
+	//   encode: writes exactly size bytes
+	//   decode: reads one element at offset and moves offset past it
+	// Like the element classes, encoding runs in two passes over one value:
+	// size records the payload size of every container in sizes, encode
+	// reads them back in the same order, so nothing is sized twice.
+	//////////////////////////////////////////////////////////////////////////
+	class CodecSizes {
+	public:
+		CodecSizes() :read(0) { }
+
+		// a slot for the container being sized, filled once its children are
+		AW::uint32 reserve() {
+			sizes.push_back(0);
+			return sizes.size() - 1;
+		}
+		void set(AW::uint32 slot, AW::uint32 size) { sizes[slot] = size; }
+		// the size of the next container encode meets
+		AW::uint32 next() { return sizes[read++]; }
+		// before sizing another value, keeps the capacity
+		void clear() {
+			sizes.clear();
+			read = 0;
+		}
+	private:
+		std::vector<AW::uint32> sizes;	// in the order the containers start
+		AW::uint32 read;
+	};
+
+	template<typename T>
+	struct Codec;
+
+	template<>
+	struct Codec<AW::uint32> {
+		// scalars have no container size, sizes is only passed along
+		static AW::uint32 size(WireFormat format, const AW::uint32& v, CodecSizes&) { return size(format, v); }
+		static void encode(WireFormat format, AW::byte*& out, const AW::uint32& v, CodecSizes&) { encode(format, out, v); }
+		static AW::uint32 size(WireFormat format, const AW::uint32& v) {
+			return ElementTrait<AW::uint32>(v).encodedSize(format);
+		}
+		static void encode(WireFormat format, AW::byte*& out, const AW::uint32& v) {
+			ElementTrait<AW::uint32>(v).encodeTo(format, out);
+		}
+		static AW::uint32 decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			auto h = readElementHeader(format, data, end, offset);
+			assert_format(h.tag == BinaryTag::UInt32);
+			return static_cast<AW::uint32>(h.value);
+		}
+	};
+
+	template<>
+	struct Codec<AW::int32> {
+		static AW::uint32 size(WireFormat format, const AW::int32& v, CodecSizes&) { return size(format, v); }
+		static void encode(WireFormat format, AW::byte*& out, const AW::int32& v, CodecSizes&) { encode(format, out, v); }
+		static AW::uint32 size(WireFormat format, const AW::int32& v) {
+			return ElementTrait<AW::int32>(v).encodedSize(format);
+		}
+		static void encode(WireFormat format, AW::byte*& out, const AW::int32& v) {
+			ElementTrait<AW::int32>(v).encodeTo(format, out);
+		}
+		static AW::int32 decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			auto h = readElementHeader(format, data, end, offset);
+			assert_format(h.tag == BinaryTag::Int32);
+			return static_cast<AW::int32>(h.value);
+		}
+	};
+
+	template<>
+	struct Codec<AW::real64> {
+		static AW::uint32 size(WireFormat format, const AW::real64& v, CodecSizes&) { return size(format, v); }
+		static void encode(WireFormat format, AW::byte*& out, const AW::real64& v, CodecSizes&) { encode(format, out, v); }
+		static AW::uint32 size(WireFormat format, const AW::real64& v) {
+			return ElementTrait<AW::real64>(v).encodedSize(format);
+		}
+		static void encode(WireFormat format, AW::byte*& out, const AW::real64& v) {
+			ElementTrait<AW::real64>(v).encodeTo(format, out);
+		}
+		static AW::real64 decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			auto h = readElementHeader(format, data, end, offset);
+			assert_format(h.tag == BinaryTag::Real64);
+			return bitsReal64(h.value);
+		}
+	};
+
+	template<>
+	struct Codec<StringRef> {
+		static AW::uint32 size(WireFormat format, const StringRef& v, CodecSizes&) { return size(format, v); }
+		static void encode(WireFormat format, AW::byte*& out, const StringRef& v, CodecSizes&) { encode(format, out, v); }
+		static AW::uint32 size(WireFormat format, const StringRef& v) {
+			return headerSize(format, sizeof(AW::character) * v.size) + sizeof(AW::character) * v.size;
+		}
+		static void encode(WireFormat format, AW::byte*& out, const StringRef& v) {
+			writeHeader(format, out, StringTypeName, BinaryTag::String, sizeof(AW::character) * v.size);
+			writeChars(out, v.data, v.size);
+		}
+		static StringRef decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			auto h = readElementHeader(format, data, end, offset);
+			assert_format(h.tag == BinaryTag::String);
+			return StringRef(reinterpret_cast<const AW::character*>(data + h.offset), h.size / sizeof(AW::character));
+		}
+	};
+
+	template<>
+	struct Codec<AW::string> {
+		static AW::uint32 size(WireFormat format, const AW::string& v, CodecSizes&) { return size(format, v); }
+		static void encode(WireFormat format, AW::byte*& out, const AW::string& v, CodecSizes&) { encode(format, out, v); }
+		static AW::uint32 size(WireFormat format, const AW::string& v) {
+			return Codec<StringRef>::size(format, StringRef(v.data(), v.size()));
+		}
+		static void encode(WireFormat format, AW::byte*& out, const AW::string& v) {
+			Codec<StringRef>::encode(format, out, StringRef(v.data(), v.size()));
+		}
+		static AW::string decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			return Codec<StringRef>::decode(format, data, end, offset).toString();
+		}
+	};
+
+	// vector (Tuple)
+	template<typename ElementT>
+	struct TupleArrayCodec {
+		static AW::uint32 size(WireFormat format, const std::vector<ElementT>& v, CodecSizes& sizes) {
+			AW::uint32 slot = sizes.reserve(), payload = 0;
+			for (auto& e : v)
+				payload += Codec<ElementT>::size(format, e, sizes);
+			sizes.set(slot, payload);
+			return headerSize(format, payload) + payload;
+		}
+		static void encode(WireFormat format, AW::byte*& out, const std::vector<ElementT>& v, CodecSizes& sizes) {
+			writeHeader(format, out, TupleTypeName, BinaryTag::Tuple, sizes.next());
+			for (auto& e : v)
+				Codec<ElementT>::encode(format, out, e, sizes);
+		}
+		static std::vector<ElementT> decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			auto h = readElementHeader(format, data, end, offset);
+			assert_format(h.tag == BinaryTag::Tuple);
+			std::vector<ElementT> ret;
+			for (AW::uint32 pos = h.offset; pos < offset;)
+				ret.push_back(Codec<ElementT>::decode(format, data, offset, pos));
+			return ret;
+		}
+	};
+	template<typename ElementT>
+	struct Codec<std::vector<ElementT>> :TupleArrayCodec<ElementT> { };
+
+	// vector of numbers, one packed block in the binary format
+	template<typename T>
+	struct PackedArrayCodec {
+		static AW::uint32 size(WireFormat format, const std::vector<T>& v, CodecSizes& sizes) {
+			if (format == WireFormat::Text)
+				return TupleArrayCodec<T>::size(format, v, sizes);
+			return headerSize(format, v.size() * sizeof(T)) + v.size() * sizeof(T);
+		}
+		static void encode(WireFormat format, AW::byte*& out, const std::vector<T>& v, CodecSizes& sizes) {
+			if (format == WireFormat::Text) {
+				TupleArrayCodec<T>::encode(format, out, v, sizes);
+				return;
+			}
+			writeHeader(format, out, PackedTrait<T>::getType(), PackedTrait<T>::tag, v.size() * sizeof(T));
+			if (!v.empty())
+				copyLittleEndian<T>(out, v.data(), v.size());
+			out += v.size() * sizeof(T);
+		}
+		// either a packed block or a tuple of scalars
+		static std::vector<T> decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			AW::uint32 pos = offset;
+			auto h = readElementHeader(format, data, end, pos);
+			if (h.tag != PackedTrait<T>::tag)
+				return TupleArrayCodec<T>::decode(format, data, end, offset);
+			offset = pos;
+			std::vector<T> ret(h.size / sizeof(T));
+			if (!ret.empty())
+				copyLittleEndian<T>(ret.data(), data + h.offset, ret.size());
+			return ret;
+		}
+	};
+	template<>
+	struct Codec<std::vector<AW::uint32>> :PackedArrayCodec<AW::uint32> { };
+	template<>
+	struct Codec<std::vector<AW::int32>> :PackedArrayCodec<AW::int32> { };
+	template<>
+	struct Codec<std::vector<AW::real64>> :PackedArrayCodec<AW::real64> { };
+
+	// map
+	template<typename KeyT, typename ValT>
+	struct Codec<std::map<KeyT, ValT>> {
+		static AW::uint32 size(WireFormat format, const std::map<KeyT, ValT>& m, CodecSizes& sizes) {
+			AW::uint32 slot = sizes.reserve(), payload = 0;
+			for (auto& e : m) {
+				payload += Codec<KeyT>::size(format, e.first, sizes);
+				payload += Codec<ValT>::size(format, e.second, sizes);
+			}
+			sizes.set(slot, payload);
+			return headerSize(format, payload) + payload;
+		}
+		static void encode(WireFormat format, AW::byte*& out, const std::map<KeyT, ValT>& m, CodecSizes& sizes) {
+			writeHeader(format, out, MapTypeName, BinaryTag::Map, sizes.next());
+			for (auto& e : m) {
+				Codec<KeyT>::encode(format, out, e.first, sizes);
+				Codec<ValT>::encode(format, out, e.second, sizes);
+			}
+		}
+		static std::map<KeyT, ValT> decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			auto h = readElementHeader(format, data, end, offset);
+			assert_format(h.tag == BinaryTag::Map);
+			std::map<KeyT, ValT> ret;
+			for (AW::uint32 pos = h.offset; pos < offset;) {
+				auto key = Codec<KeyT>::decode(format, data, offset, pos);
+				ret[key] = Codec<ValT>::decode(format, data, offset, pos);
+			}
+			return ret;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Tuples of loose values (parameter lists)
+	//////////////////////////////////////////////////////////////////////////
+	template<typename...T>
+	AW::uint32 tupleSize(WireFormat format, CodecSizes& sizes, const T&... v) {
+		AW::uint32 slot = sizes.reserve(), payload = 0;
+		// braced lists evaluate in order
+		int order[] = { 0, (payload += Codec<T>::size(format, v, sizes), 0)... };
+		(void)order;
+		sizes.set(slot, payload);
+		return headerSize(format, payload) + payload;
+	}
+	// after tupleSize with the same sizes
+	template<typename...T>
+	void encodeTuple(WireFormat format, AW::byte*& out, CodecSizes& sizes, const T&... v) {
+		writeHeader(format, out, TupleTypeName, BinaryTag::Tuple, sizes.next());
+		int order[] = { 0, (Codec<T>::encode(format, out, v, sizes), 0)... };
+		(void)order;
+	}
+	// v encoded into out, resized to fit
+	template<typename T>
+	void encodeValue(WireFormat format, const T& v, ByteBuffer& out) {
+		static thread_local CodecSizes sizes;
+		sizes.clear();
+		out.resize(Codec<T>::size(format, v, sizes));
+		AW::byte* p = out.data();
+		Codec<T>::encode(format, p, v, sizes);
+	}
+
+	template<typename...T>
+	struct Codec<std::tuple<T...>> {
+		static std::tuple<T...> decode(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+			auto h = readElementHeader(format, data, end, offset);
+			assert_format(h.tag == BinaryTag::Tuple);
+			return decodePayload(format, data, h.offset, offset);
+		}
+		// the elements between begin and end, without the tuple header
+		static std::tuple<T...> decodePayload(WireFormat format, const AW::byte* data, AW::uint32 begin, AW::uint32 end) {
+			AW::uint32 pos = begin;
+			auto ret = std::tuple<T...>{ Codec<T>::decode(format, data, end, pos)... };
+			assert_format(pos == end);
+			return ret;
+		}
+	};
+
+	// calls func with the elements of a tuple
+	template<typename FuncT, typename TupleT, size_t...I>
+	auto applyTuple(FuncT& func, TupleT&& args, std::index_sequence<I...>) -> decltype(func(std::get<I>(std::forward<TupleT>(args))...)) {
+		return func(std::get<I>(std::forward<TupleT>(args))...);
+	}
+	template<typename FuncT, typename TupleT>
+	auto applyTuple(FuncT& func, TupleT&& args) -> decltype(applyTuple(func, std::forward<TupleT>(args), std::make_index_sequence<std::tuple_size<typename std::decay<TupleT>::type>::value>())) {
+		return applyTuple(func, std::forward<TupleT>(args), std::make_index_sequence<std::tuple_size<typename std::decay<TupleT>::type>::value>());
+	}
+}
+
+#endif
@@ -10,6 +10,13 @@
 #include <map>
 #include <functional>
 #include <codecvt>
+#include <cstring>
+#ifdef __AW_SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace AW {
 	//////////////////////////////////////////////////////////////////////////
@@ -22,6 +29,42 @@ namespace AW {
 	constexpr AW::character* Real64TypeName = t("R8");
 	constexpr AW::character* TupleTypeName = t("TP");
 	constexpr AW::character* MapTypeName = t("MP");
+	// packed arrays only exist in the binary format, text peers get tuples
+	constexpr const AW::character* UInt32ArrayTypeName = t("AU");
+	constexpr const AW::character* Int32ArrayTypeName = t("AI");
+	constexpr const AW::character* Real64ArrayTypeName = t("AR");
+	// a failed call, the payload is the message text
+	constexpr const AW::character* ErrorTypeName = t("ER");
+
+	//////////////////////////////////////////////////////////////////////////
+	// Binary wire format
+	// Every element starts with a one byte tag, followed by a fixed little-endian
+	// scalar or by a varint byte length and the payload.
+	// No tag equals '<', so the two formats can be told apart by the first byte.
+	//////////////////////////////////////////////////////////////////////////
+	enum class WireFormat : AW::byte { Text = 0, Binary = 1 };
+	enum class BinaryTag : AW::byte {
+		String = 0x01, UInt32 = 0x02, Int32 = 0x03, Real64 = 0x04,
+		Tuple = 0x10, Map = 0x11,
+		UInt32Array = 0x20, Int32Array = 0x21, Real64Array = 0x22,
+		Error = 0x30,
+		// string table at the start of a message, and references into it
+		StringTable = 0x31, Interned = 0x05
+	};
+	typedef std::vector<AW::byte> ByteBuffer;
+
+	// Characters inside someone else's buffer
+	struct StringRef {
+		StringRef() :data(nullptr), size(0) { }
+		StringRef(const AW::character* data, AW::uint32 size) :data(data), size(size) { }
+		AW::string toString() const { return AW::string(data, size); }
+		bool operator==(const StringRef& r) const { return size == r.size && std::equal(data, data + size, r.data); }
+		bool operator==(const AW::string& r) const { return size == r.size() && std::equal(data, data + size, r.data()); }
+		bool operator==(const AW::character* r) const { return std::char_traits<AW::character>::length(r) == size && std::equal(data, data + size, r); }
+
+		const AW::character* data;
+		AW::uint32 size;
+	};
 
 	//////////////////////////////////////////////////////////////////////////
 	// Declarations
@@ -33,7 +76,7 @@ namespace AW {
 	// Helper Functions
 	//////////////////////////////////////////////////////////////////////////
 	inline bool atEof(std::basic_stringstream<AW::character>& s) {
-		return (size_t)s.tellg() == (s.str().size() * sizeof(AW::character));
+		return s.rdbuf()->in_avail() <= 0;
 	}
 	inline void assert_format(bool condition) {
 		if (!condition) {
@@ -41,6 +84,219 @@ namespace AW {
 		}
 	}
 
+	// hex length of the text format, up to 8 digits
+	inline AW::uint32 parseHex(const AW::character* s, AW::uint32 n) {
+		assert_format(n > 0 && n <= sizeof(AW::uint32) * 2);
+#if defined __AW_UTF8__ && defined __AW_LITTLE_ENDIAN__
+		// All digits in one word, padded with '0' in front: every byte is
+		// checked and turned into its nibble at once, then the nibbles are
+		// packed pairwise. A byte is in [lo, hi] when b + 0x80 - lo has its top
+		// bit set and b + 0x7f - hi has not, which holds for bytes below 0x80.
+		const AW::uint64 ones = 0x0101010101010101ull, high = ones * 0x80;
+		// two loads that may overlap, nothing past the digits is read
+		AW::uint64 x;
+		if (n >= 4) {
+			AW::uint32 a, b;
+			memcpy(&a, s, 4);
+			memcpy(&b, s + n - 4, 4);
+			x = a | static_cast<AW::uint64>(b) << (8 * (n - 4));
+		}
+		else if (n >= 2) {
+			unsigned short a, b;
+			memcpy(&a, s, 2);
+			memcpy(&b, s + n - 2, 2);
+			x = a | static_cast<AW::uint64>(b) << (8 * (n - 2));
+		}
+		else
+			x = static_cast<AW::byte>(s[0]);
+		x = (x << (8 * (8 - n))) | ((ones * '0') & ((1ull << (8 * (8 - n))) - 1));
+		AW::uint64 lower = x | ones * 0x20;
+		AW::uint64 digit = (x + ones * (0x80 - '0')) & ~(x + ones * (0x7f - '9'));
+		AW::uint64 letter = (lower + ones * (0x80 - 'a')) & ~(lower + ones * (0x7f - 'f'));
+		assert_format((x & high) == 0 && ((digit | letter) & high) == high);
+		x = (x & ones * 0x0f) + ((letter & high) >> 7) * 9;
+		x = ((x & 0x0f000f000f000f00ull) >> 8) | ((x & 0x000f000f000f000full) << 4);
+		x = ((x & 0x00ff000000ff0000ull) >> 16) | ((x & 0x000000ff000000ffull) << 8);
+		return static_cast<AW::uint32>((x >> 32) | (x << 16));
+#else
+		AW::uint32 value = 0;
+		for (AW::uint32 i = 0; i < n; ++i) {
+			AW::character c = s[i];
+			AW::uint32 d;
+			if (c >= t('0') && c <= t('9')) d = c - t('0');
+			else if (c >= t('a') && c <= t('f')) d = c - t('a') + 10;
+			else if (c >= t('A') && c <= t('F')) d = c - t('A') + 10;
+			else { assert_format(false); d = 0; }
+			value = (value << 4) | d;
+		}
+		return value;
+#endif
+	}
+
+	inline AW::uint32 lowestBit(AW::uint32 mask) {
+#ifdef _MSC_VER
+		unsigned long i;
+		_BitScanForward(&i, mask);
+		return i;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	// A text header is at most this long, "<TT " 8 digits and '>'
+	constexpr AW::uint32 TEXT_HEADER_WINDOW = 16;
+	static_assert(TypeStringLength + 3 + sizeof(AW::uint32) * 2 <= TEXT_HEADER_WINDOW, "text header window");
+
+	// Position of the '>' closing the text header at pos, last when it has
+	// not arrived. With a whole window at hand SSE2 checks the '<' and the
+	// blank and finds the '>' in one load, otherwise it goes char by char.
+	inline AW::uint32 findHeaderEnd(const AW::character* s, AW::uint32 pos, AW::uint32 last) {
+		AW::uint32 hexStart = pos + TypeStringLength + 2;
+		if (hexStart > last)
+			return last;
+#if defined __AW_SSE2__ && defined __AW_UTF8__
+		if (last - pos >= TEXT_HEADER_WINDOW) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + pos));
+			AW::uint32 open = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+			AW::uint32 blank = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+			AW::uint32 close = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+			close = (close >> (TypeStringLength + 2)) & ((1u << (sizeof(AW::uint32) * 2 + 1)) - 1);
+			assert_format((open & 1) != 0 && (blank >> (TypeStringLength + 1) & 1) != 0 && close != 0);
+			return hexStart + lowestBit(close);
+		}
+#endif
+		assert_format(s[pos] == t('<') && s[pos + TypeStringLength + 1] == t(' '));
+		AW::uint32 hexEnd = hexStart;
+		while (hexEnd < last && s[hexEnd] != t('>')) {
+			assert_format(hexEnd < hexStart + sizeof(AW::uint32) * 2);
+			hexEnd++;
+		}
+		return hexEnd;
+	}
+
+	inline AW::uint32 varintSize(AW::uint32 value) {
+		AW::uint32 n = 1;
+		while (value >= 0x80) {
+			value >>= 7;
+			n++;
+		}
+		return n;
+	}
+	inline void writeVarint(AW::byte*& out, AW::uint32 value) {
+		while (value >= 0x80) {
+			*out++ = static_cast<AW::byte>(value | 0x80);
+			value >>= 7;
+		}
+		*out++ = static_cast<AW::byte>(value);
+	}
+	inline AW::uint32 readVarint(const AW::byte* data, AW::uint32 length, AW::uint32& offset) {
+		AW::uint32 value = 0;
+		for (AW::uint32 shift = 0; shift < 35; shift += 7) {
+			assert_format(offset < length);
+			AW::byte b = data[offset++];
+			value |= static_cast<AW::uint32>(b & 0x7f) << shift;
+			if ((b & 0x80) == 0)
+				return value;
+		}
+		assert_format(false);
+		return 0; // never here
+	}
+	inline void writeFixed32(AW::byte*& out, AW::uint32 value) {
+		for (int i = 0; i < 4; ++i)
+			*out++ = static_cast<AW::byte>(value >> (8 * i));
+	}
+	inline AW::uint32 readFixed32(const AW::byte* data, AW::uint32 length, AW::uint32& offset) {
+		assert_format(length >= 4 && offset <= length - 4);
+		AW::uint32 value = data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16) | (static_cast<AW::uint32>(data[offset + 3]) << 24);
+		offset += 4;
+		return value;
+	}
+	inline void writeFixed64(AW::byte*& out, AW::uint64 value) {
+		for (int i = 0; i < 8; ++i)
+			*out++ = static_cast<AW::byte>(value >> (8 * i));
+	}
+	inline AW::uint64 readFixed64(const AW::byte* data, AW::uint32 length, AW::uint32& offset) {
+		assert_format(length >= 8 && offset <= length - 8);
+		AW::uint64 value = 0;
+		for (int i = 7; i >= 0; --i)
+			value = (value << 8) | data[offset + i];
+		offset += 8;
+		return value;
+	}
+	inline AW::uint64 real64Bits(AW::real64 v) {
+		AW::uint64 bits;
+		memcpy(&bits, &v, sizeof(bits));
+		return bits;
+	}
+	inline AW::real64 bitsReal64(AW::uint64 bits) {
+		AW::real64 v;
+		memcpy(&v, &bits, sizeof(v));
+		return v;
+	}
+
+	// Packed arrays are little-endian on the wire: a plain block copy on
+	// little-endian hosts, a byte swap per element elsewhere
+	template<typename T>
+	inline void copyLittleEndian(void* dst, const void* src, AW::uint32 count) {
+#ifdef __AW_LITTLE_ENDIAN__
+		memcpy(dst, src, count * sizeof(T));
+#else
+		auto d = static_cast<AW::byte*>(dst);
+		auto s = static_cast<const AW::byte*>(src);
+		for (AW::uint32 i = 0; i < count; ++i, d += sizeof(T), s += sizeof(T))
+			std::reverse_copy(s, s + sizeof(T), d);
+#endif
+	}
+	inline void writeChars(AW::byte*& out, const AW::character* s, AW::uint32 n) {
+		memcpy(out, s, n * sizeof(AW::character));
+		out += n * sizeof(AW::character);
+	}
+	inline AW::uint64 parseHex64(const AW::character* s, AW::uint32 n) {
+		assert_format(n > sizeof(AW::uint32) * 2 ? n <= sizeof(AW::uint64) * 2 : n > 0);
+		if (n <= sizeof(AW::uint32) * 2)
+			return parseHex(s, n);
+		return (static_cast<AW::uint64>(parseHex(s, n - 8)) << 32) | parseHex(s + n - 8, 8);
+	}
+	inline AW::uint32 hexDigits(AW::uint32 value) {
+		AW::uint32 n = 1;
+		while (value >= 0x10) {
+			value >>= 4;
+			n++;
+		}
+		return n;
+	}
+	inline void writeHex(AW::byte*& out, AW::uint32 value) {
+		static const AW::character digits[] = t("0123456789abcdef");
+		AW::character buffer[sizeof(AW::uint32) * 2];
+		AW::uint32 n = hexDigits(value);
+		for (AW::uint32 i = n; i > 0; --i) {
+			buffer[i - 1] = digits[value & 0xf];
+			value >>= 4;
+		}
+		writeChars(out, buffer, n);
+	}
+
+	// "<TT hexlen>" or tag + varint length, the length counts payload bytes
+	inline AW::uint32 headerSize(WireFormat format, AW::uint32 payloadSize) {
+		if (format == WireFormat::Text)
+			return (TypeStringLength + 3 + hexDigits(payloadSize)) * sizeof(AW::character);
+		return 1 + varintSize(payloadSize);
+	}
+	inline void writeHeader(WireFormat format, AW::byte*& out, const AW::character* typeName, BinaryTag tag, AW::uint32 payloadSize) {
+		if (format == WireFormat::Text) {
+			static const AW::character open = t('<'), blank = t(' '), close = t('>');
+			writeChars(out, &open, 1);
+			writeChars(out, typeName, TypeStringLength);
+			writeChars(out, &blank, 1);
+			writeHex(out, payloadSize);
+			writeChars(out, &close, 1);
+		}
+		else {
+			*out++ = static_cast<AW::byte>(tag);
+			writeVarint(out, payloadSize);
+		}
+	}
+
 	//////////////////////////////////////////////////////////////////////////
 	// Concrete Type Element Traits
 	//////////////////////////////////////////////////////////////////////////
@@ -55,48 +311,145 @@ namespace AW {
 	public:
 		explicit ElementTrait(const AW::uint32& v) :value(v) { }
 		AW::uint32 getValue() const { return value; }
-		AW::uint32 getSize() {
-			if (str.size() == 0) {
-				std::basic_stringstream<character> ss;
-				ss << std::hex << value;
-				str = ss.str();
-			}
-			return str.size() * sizeof(AW::character);
+		AW::uint32 getSize() const {
+			return hexDigits(value) * sizeof(AW::character);
 		}
-		AW::string toString() {
-			if (str.size() == 0) {
-				std::basic_stringstream<character> ss;
-				ss << value;
-				str = ss.str();
+		AW::string toString() const {
+			AW::string ret(hexDigits(value), t('0'));
+			auto out = reinterpret_cast<AW::byte*>(&ret[0]);
+			writeHex(out, value);
+			return ret;
+		}
+		// binary values are fixed size and carry no length
+		AW::uint32 encodedSize(WireFormat format) const {
+			return format == WireFormat::Text ? headerSize(format, getSize()) + getSize() : 1 + sizeof(AW::uint32);
+		}
+		void encodeTo(WireFormat format, AW::byte*& out) const {
+			if (format == WireFormat::Text) {
+				writeHeader(format, out, getType(), BinaryTag::UInt32, getSize());
+				writeHex(out, value);
+			}
+			else {
+				*out++ = static_cast<AW::byte>(BinaryTag::UInt32);
+				writeFixed32(out, value);
 			}
-			return str;
 		}
 		static const character* getType() {
 			return t("U4");
 		}
 		static std::shared_ptr<AW::uint32> fromString(const AW::string& s) {
-			std::basic_stringstream<character> ss;
-			AW::uint32 value;
-			ss << s;
-			ss >> std::hex >> value;
-			return std::shared_ptr<AW::uint32>(new AW::uint32(value));
+			return std::shared_ptr<AW::uint32>(new AW::uint32(parseHex(s.data(), s.size())));
 		}
 	private:
 		AW::uint32 value;
-		AW::string str;
+	};
+
+	// text form is the hex of the two's complement bits
+	template<>
+	class ElementTrait<AW::int32> {
+	public:
+		explicit ElementTrait(const AW::int32& v) :value(v) { }
+		AW::int32 getValue() const { return value; }
+		AW::uint32 getSize() const {
+			return ElementTrait<AW::uint32>(bits()).getSize();
+		}
+		AW::string toString() const {
+			return ElementTrait<AW::uint32>(bits()).toString();
+		}
+		AW::uint32 encodedSize(WireFormat format) const {
+			return format == WireFormat::Text ? headerSize(format, getSize()) + getSize() : 1 + sizeof(AW::int32);
+		}
+		void encodeTo(WireFormat format, AW::byte*& out) const {
+			if (format == WireFormat::Text) {
+				writeHeader(format, out, getType(), BinaryTag::Int32, getSize());
+				writeHex(out, bits());
+			}
+			else {
+				*out++ = static_cast<AW::byte>(BinaryTag::Int32);
+				writeFixed32(out, bits());
+			}
+		}
+		static const character* getType() {
+			return t("I4");
+		}
+		static std::shared_ptr<AW::int32> fromString(const AW::string& s) {
+			return std::shared_ptr<AW::int32>(new AW::int32(static_cast<AW::int32>(parseHex(s.data(), s.size()))));
+		}
+	private:
+		AW::uint32 bits() const { return static_cast<AW::uint32>(value); }
+		AW::int32 value;
+	};
+
+	// text form is the hex of the IEEE 754 bits, always 16 digits
+	template<>
+	class ElementTrait<AW::real64> {
+	public:
+		explicit ElementTrait(const AW::real64& v) :value(v) { }
+		AW::real64 getValue() const { return value; }
+		AW::uint32 getSize() const {
+			return sizeof(AW::uint64) * 2 * sizeof(AW::character);
+		}
+		AW::string toString() const {
+			AW::string ret(sizeof(AW::uint64) * 2, t('0'));
+			auto out = reinterpret_cast<AW::byte*>(&ret[0]);
+			writeBits(out);
+			return ret;
+		}
+		AW::uint32 encodedSize(WireFormat format) const {
+			return format == WireFormat::Text ? headerSize(format, getSize()) + getSize() : 1 + sizeof(AW::real64);
+		}
+		void encodeTo(WireFormat format, AW::byte*& out) const {
+			if (format == WireFormat::Text) {
+				writeHeader(format, out, getType(), BinaryTag::Real64, getSize());
+				writeBits(out);
+			}
+			else {
+				*out++ = static_cast<AW::byte>(BinaryTag::Real64);
+				writeFixed64(out, real64Bits(value));
+			}
+		}
+		static const character* getType() {
+			return t("R8");
+		}
+		static std::shared_ptr<AW::real64> fromString(const AW::string& s) {
+			return std::shared_ptr<AW::real64>(new AW::real64(bitsReal64(parseHex64(s.data(), s.size()))));
+		}
+	private:
+		void writeBits(AW::byte*& out) const {
+			static const AW::character digits[] = t("0123456789abcdef");
+			AW::character buffer[sizeof(AW::uint64) * 2];
+			AW::uint64 bits = real64Bits(value);
+			for (int i = sizeof(buffer) / sizeof(AW::character) - 1; i >= 0; --i, bits >>= 4)
+				buffer[i] = digits[bits & 0xf];
+			writeChars(out, buffer, sizeof(buffer) / sizeof(AW::character));
+		}
+		AW::real64 value;
 	};
 
 	template<>
 	class ElementTrait<AW::string> {
 	public:
 		explicit ElementTrait(const AW::string& s) :str(s) { }
-		AW::string getValue() const { return str; }
+		// reference characters inside a received buffer, kept alive by owner
+		ElementTrait(std::shared_ptr<const AW::byte> owner, const AW::character* data, AW::uint32 size)
+			:owner(owner), view(data, size) { }
+		AW::string getValue() const { return owner ? view.toString() : str; }
+		StringRef getView() const { return owner ? view : StringRef(str.data(), str.size()); }
 
 		AW::uint32 getSize() {
-			return sizeof(AW::character) * str.size();
+			return sizeof(AW::character) * getView().size;
 		}
 		AW::string toString() {
-			return str;
+			return getValue();
+		}
+		AW::uint32 encodedSize(WireFormat format) const {
+			auto size = sizeof(AW::character) * getView().size;
+			return headerSize(format, size) + size;
+		}
+		void encodeTo(WireFormat format, AW::byte*& out) const {
+			auto v = getView();
+			writeHeader(format, out, getType(), BinaryTag::String, sizeof(AW::character) * v.size);
+			writeChars(out, v.data, v.size);
 		}
 
 		static std::shared_ptr<AW::string> fromString(const AW::string& ss) {
@@ -108,6 +461,8 @@ namespace AW {
 		}
 	private:
 		AW::string str;
+		std::shared_ptr<const AW::byte> owner;
+		StringRef view;
 	};
 
 	//////////////////////////////////////////////////////////////////////////
@@ -115,8 +470,25 @@ namespace AW {
 	//////////////////////////////////////////////////////////////////////////
 	class ElementBase {
 	public:
-		virtual AW::string toString() = 0;
+		// Encoding runs in two passes: encodedSize walks the tree once and caches
+		// the size of every container, encodeTo then writes straight into a buffer
+		// of exactly that size. Call encodedSize with the same format first.
+		virtual AW::uint32 encodedSize(WireFormat format) = 0;
+		virtual void encodeTo(WireFormat format, AW::byte*& out) = 0;
 		virtual AW::string getType() const = 0;
+
+		AW::string toString() {
+			AW::string ret(encodedSize(WireFormat::Text) / sizeof(AW::character), t('\0'));
+			auto out = reinterpret_cast<AW::byte*>(&ret[0]);
+			encodeTo(WireFormat::Text, out);
+			return ret;
+		}
+		void toBinary(ByteBuffer& out) {
+			auto start = out.size();
+			out.resize(start + encodedSize(WireFormat::Binary));
+			auto p = out.data() + start;
+			encodeTo(WireFormat::Binary, p);
+		}
 	};
 
 	//////////////////////////////////////////////////////////////////////////
@@ -170,16 +542,18 @@ namespace AW {
 			return ret;
 		}
 
-		virtual AW::string toString() override {
-			std::basic_stringstream<AW::character> ss, buffer;
-
-			for (auto element : elements) {
-				buffer << element->toString();
+		virtual AW::uint32 encodedSize(WireFormat format) override {
+			payloadSize = 0;
+			for (auto& element : elements) {
+				payloadSize += element->encodedSize(format);
+			}
+			return headerSize(format, payloadSize) + payloadSize;
+		}
+		virtual void encodeTo(WireFormat format, AW::byte*& out) override {
+			writeHeader(format, out, TupleTypeName, BinaryTag::Tuple, payloadSize);
+			for (auto& element : elements) {
+				element->encodeTo(format, out);
 			}
-			AW::string bufStr(buffer.str());
-
-			ss << t("<") << TupleTypeName << t(" ") << std::hex << bufStr.size() * sizeof(AW::character) << t(">") << bufStr;
-			return ss.str();
 		}
 		static std::shared_ptr<TupleType> fromStringData(std::basic_stringstream<AW::character>& ss) {
 			std::shared_ptr<TupleType> ret(new TupleType);
@@ -197,6 +571,7 @@ namespace AW {
 		}
 	private:
 		std::vector<std::shared_ptr<ElementBase>> elements;
+		AW::uint32 payloadSize = 0;
 	};
 
 	//////////////////////////////////////////////////////////////////////////
@@ -209,36 +584,43 @@ namespace AW {
 		template<typename KeyT, typename ValT>
 		MapType(const std::map<KeyT, ValT>& m) {
 			for (auto e : m) {
-				maps[e.first->toString()] = e.second;
+				maps[e.first->toString()] = std::make_pair(e.first, e.second);
 			}
 		}
 
 		template<typename KeyT, typename ValT>
-		std::shared_ptr<ValT> get(const KeyT& key) {
-			return dynamic_cast<std::shared_ptr<ValT>>(maps[key.toString]);
+		std::shared_ptr<ValT> get(KeyT key) {
+			return std::dynamic_pointer_cast<ValT>(maps[key.toString()].second);
 		}
 
 		void for_each_const(std::function<void(std::shared_ptr<ElementBase>, std::shared_ptr<ElementBase>)> func) const {
 			for (auto element : maps) {
-				std::basic_stringstream<AW::character> ss(element.first);
-				func(fromString(ss), element.second);
+				func(element.second.first, element.second.second);
 			}
 		}
 
 		void add(std::shared_ptr<ElementBase> key, std::shared_ptr<ElementBase> value) {
-			maps[key->toString()] = value;
+			maps[key->toString()] = std::make_pair(key, value);
+		}
+		void add(const AW::string& keyText, std::shared_ptr<ElementBase> key, std::shared_ptr<ElementBase> value) {
+			maps[keyText] = std::make_pair(key, value);
 		}
 		virtual AW::string getType() const override {
 			return MapTypeName;
 		}
-		virtual AW::string toString() override {
-			std::basic_stringstream<AW::character> ss, buffer;
-			for (auto element : maps) {
-				buffer << element.first << element.second->toString();
+		virtual AW::uint32 encodedSize(WireFormat format) override {
+			payloadSize = 0;
+			for (auto& element : maps) {
+				payloadSize += element.second.first->encodedSize(format) + element.second.second->encodedSize(format);
+			}
+			return headerSize(format, payloadSize) + payloadSize;
+		}
+		virtual void encodeTo(WireFormat format, AW::byte*& out) override {
+			writeHeader(format, out, MapTypeName, BinaryTag::Map, payloadSize);
+			for (auto& element : maps) {
+				element.second.first->encodeTo(format, out);
+				element.second.second->encodeTo(format, out);
 			}
-			auto bufStr = buffer.str();
-			ss << "<" << MapTypeName << " " << std::hex << sizeof(AW::character) * bufStr.size() << ">" << bufStr;
-			return ss.str();
 		}
 		static std::shared_ptr<MapType> fromStringData(std::basic_stringstream<AW::character>& ss) {
 			std::shared_ptr<MapType> ret(new MapType);
@@ -246,31 +628,37 @@ namespace AW {
 				assert_format(!ss.bad());
 				auto key = fromString(ss);
 				auto val = fromString(ss);
-				ret->maps[key->toString()] = val;
+				ret->add(key, val);
 			}
 			return ret;
 		}
 	private:
-		std::map<AW::string, std::shared_ptr<ElementBase>> maps;
+		// keyed by the text form of the key, so equal keys collapse like before
+		std::map<AW::string, std::pair<std::shared_ptr<ElementBase>, std::shared_ptr<ElementBase>>> maps;
+		AW::uint32 payloadSize = 0;
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// Concrete Type Element(string, uint32)
+	// Concrete Type Element(string, uint32, int32, real64)
 	//////////////////////////////////////////////////////////////////////////
 	template<typename T, typename TraitT = ElementTrait<T>>
 	class Element :public ElementBase {
 	public:
 		explicit Element(const T& v) :trait(v) { }
-		AW::string toString() {
-			std::basic_stringstream<AW::character> ss;
-			ss << t("<") << TraitT::getType() << t(" ") << std::hex << trait.getSize() << t(">");
-			ss << trait.toString();
-			return ss.str();
+		Element(std::shared_ptr<const AW::byte> owner, const AW::character* data, AW::uint32 size) :trait(owner, data, size) { }
+		virtual AW::uint32 encodedSize(WireFormat format) override {
+			return trait.encodedSize(format);
+		}
+		virtual void encodeTo(WireFormat format, AW::byte*& out) override {
+			trait.encodeTo(format, out);
 		}
 
 		T getValue() const {
 			return trait.getValue();
 		}
+		StringRef getView() const {
+			return trait.getView();
+		}
 		AW::string getType() const {
 			return TraitT::getType();
 		}
@@ -284,64 +672,349 @@ namespace AW {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// Create an element from string
+	// Packed numeric arrays
 	//////////////////////////////////////////////////////////////////////////
-	static std::shared_ptr<ElementBase> fromString(std::basic_stringstream<AW::character>& ss) {
-		//std::cout << AwStringToStdString(ss.str()) << std::endl;
-		character leftAngleBracket, blankspace;
-		character typeBuffer[TypeStringLength + 1]; typeBuffer[TypeStringLength] = t('\0');
-		character sizeString[sizeof(AW::uint32) * 2 + 1]; sizeString[sizeof(AW::uint32) * 2] = t('\0');
-		ss.read(&leftAngleBracket, 1);
-		ss.read(typeBuffer, TypeStringLength);
-		AW::string type(typeBuffer, TypeStringLength);
-		ss.read(&blankspace, 1);
-		assert_format(leftAngleBracket == t('<'));
-		assert_format(blankspace == t(' '));
-
-		AW::uint32 pos = 0, length;
-		while (true) {
-			character c;
-			assert_format(!ss.eof() && !ss.bad());
-			ss.read(&c, 1);
-			assert_format(ss.gcount() == 1);
-
-			if (c != t('>'))
-				sizeString[pos++] = c;
-			else
-				break;
+	template<typename T>
+	struct PackedTrait {
+		static constexpr bool packed = false;
+	};
+	template<>
+	struct PackedTrait<AW::uint32> {
+		static constexpr bool packed = true;
+		static constexpr BinaryTag tag = BinaryTag::UInt32Array;
+		static const AW::character* getType() { return UInt32ArrayTypeName; }
+	};
+	template<>
+	struct PackedTrait<AW::int32> {
+		static constexpr bool packed = true;
+		static constexpr BinaryTag tag = BinaryTag::Int32Array;
+		static const AW::character* getType() { return Int32ArrayTypeName; }
+	};
+	template<>
+	struct PackedTrait<AW::real64> {
+		static constexpr bool packed = true;
+		static constexpr BinaryTag tag = BinaryTag::Real64Array;
+		static const AW::character* getType() { return Real64ArrayTypeName; }
+	};
+
+	// One little-endian block in the binary format, a tuple of scalars in the
+	// text format so old peers still understand it
+	template<typename T>
+	class ArrayType :public ElementBase {
+	public:
+		explicit ArrayType(std::vector<T> values) :values(std::move(values)) { }
+		// decodes count elements from a little-endian block
+		ArrayType(const AW::byte* data, AW::uint32 count) :values(count) {
+			if (count > 0)
+				copyLittleEndian<T>(values.data(), data, count);
+		}
+
+		const std::vector<T>& getValues() const { return values; }
+		uint32 size() const { return values.size(); }
+
+		virtual AW::uint32 encodedSize(WireFormat format) override {
+			if (format == WireFormat::Binary)
+				payloadSize = values.size() * sizeof(T);
+			else {
+				payloadSize = 0;
+				for (auto& v : values)
+					payloadSize += ElementTrait<T>(v).encodedSize(format);
+			}
+			return headerSize(format, payloadSize) + payloadSize;
+		}
+		virtual void encodeTo(WireFormat format, AW::byte*& out) override {
+			if (format == WireFormat::Binary) {
+				writeHeader(format, out, PackedTrait<T>::getType(), PackedTrait<T>::tag, payloadSize);
+				if (!values.empty())
+					copyLittleEndian<T>(out, values.data(), values.size());
+				out += payloadSize;
+			}
+			else {
+				writeHeader(format, out, TupleTypeName, BinaryTag::Tuple, payloadSize);
+				for (auto& v : values)
+					ElementTrait<T>(v).encodeTo(format, out);
+			}
 		}
-		sizeString[pos] = t('\0');
-		// string to uint32
-		std::basic_stringstream<AW::character> bss(sizeString);
-		bss >> std::hex >> length;
-		AW::character* contentBuffer = new AW::character[length];
-		//std::cout << ss.str().size() << std::endl;
+		virtual AW::string getType() const override {
+			return PackedTrait<T>::getType();
+		}
+	private:
+		std::vector<T> values;
+		AW::uint32 payloadSize = 0;
+	};
+
+	// Moves a packed array element into out, false if e is something else
+	template<typename T>
+	bool readPackedElement(const std::shared_ptr<ElementBase>& e, std::vector<T>& out, std::true_type) {
+		auto a = dynamic_cast<ArrayType<T>*>(e.get());
+		if (a == nullptr)
+			return false;
+		out = a->getValues();
+		return true;
+	}
+	template<typename T>
+	bool readPackedElement(const std::shared_ptr<ElementBase>&, std::vector<T>&, std::false_type) {
+		return false;
+	}
+	template<typename T>
+	bool readPackedElement(const std::shared_ptr<ElementBase>& e, std::vector<T>& out) {
+		return readPackedElement(e, out, std::integral_constant<bool, PackedTrait<T>::packed>());
+	}
+
+	// Packed array for numbers, tuple of elements for everything else
+	template<typename T>
+	std::shared_ptr<ElementBase> makePackedElement(const std::vector<T>& v, std::true_type) {
+		return std::shared_ptr<ElementBase>(new ArrayType<T>(v));
+	}
+	template<typename T>
+	std::shared_ptr<ElementBase> makePackedElement(const std::vector<T>&, std::false_type) {
+		return nullptr;
+	}
+	template<typename T>
+	std::shared_ptr<ElementBase> makePackedElement(const std::vector<T>& v) {
+		return makePackedElement(v, std::integral_constant<bool, PackedTrait<T>::packed>());
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Element headers, shared by the decoders
+	//////////////////////////////////////////////////////////////////////////
+	struct ElementHeader {
+		BinaryTag tag;
+		AW::uint32 offset;	// payload start, in bytes
+		AW::uint32 size;	// payload bytes
+		AW::uint64 value;	// numbers only, raw bits of int32 and real64
+	};
+
+	inline WireFormat detectFormat(const AW::byte* data) {
+		return data[0] == t('<') ? WireFormat::Text : WireFormat::Binary;
+	}
 
-		//auto readCount = ss.readsome(contentBuffer, length);
-		ss.read(contentBuffer, length);
-		auto readCount = ss.gcount();
+	//////////////////////////////////////////////////////////////////////////
+	// String table
+	// A binary message may start with a table of the strings it repeats:
+	//   StringTable, varint size, fixed32 count, count fixed32 entry offsets,
+	//   then the entries as String elements.
+	// Each use of an entry is an Interned tag and the varint entry index.
+	//////////////////////////////////////////////////////////////////////////
+	// where the root element starts, after the table if there is one
+	inline AW::uint32 messageBodyOffset(WireFormat format, const AW::byte* data, AW::uint32 length) {
+		if (format == WireFormat::Text || data[0] != static_cast<AW::byte>(BinaryTag::StringTable))
+			return 0;
+		AW::uint32 offset = 1;
+		AW::uint32 size = readVarint(data, length, offset);
+		assert_format(size <= length - offset);
+		return offset + size;
+	}
+	// the String header of table entry index, data is the start of the message
+	inline ElementHeader readInternedString(const AW::byte* data, AW::uint32 end, AW::uint32 index) {
+		assert_format(end > 0 && data[0] == static_cast<AW::byte>(BinaryTag::StringTable));
+		AW::uint32 pos = 1;
+		AW::uint32 tableEnd = readVarint(data, end, pos);
+		assert_format(tableEnd <= end - pos);
+		tableEnd += pos;
+		AW::uint32 count = readFixed32(data, tableEnd, pos);
+		assert_format(index < count && count <= (tableEnd - pos) / 4);
+		pos += 4 * index;
+		AW::uint32 entry = readFixed32(data, tableEnd, pos);
+		assert_format(entry < tableEnd && data[entry] == static_cast<AW::byte>(BinaryTag::String));
+		entry++;
+		ElementHeader h;
+		h.tag = BinaryTag::String;
+		h.size = readVarint(data, tableEnd, entry);
+		h.offset = entry;
+		h.value = 0;
+		assert_format(h.size <= tableEnd - h.offset && h.size % sizeof(AW::character) == 0);
+		return h;
+	}
 
-		assert_format(readCount == length);
-		AW::string content(contentBuffer, length);
+	// the tag of a text format type name
+	inline BinaryTag textTag(const StringRef& type) {
+		if (type == StringTypeName) return BinaryTag::String;
+		if (type == UInt32TypeName) return BinaryTag::UInt32;
+		if (type == Int32TypeName) return BinaryTag::Int32;
+		if (type == Real64TypeName) return BinaryTag::Real64;
+		if (type == TupleTypeName) return BinaryTag::Tuple;
+		if (type == MapTypeName) return BinaryTag::Map;
+		if (type == ErrorTypeName) return BinaryTag::Error;
+		assert_format(false);
+		return BinaryTag::Error; // never here
+	}
 
-		if (type == ElementTrait<AW::string>::getType()) {
-			return Element<AW::string>::fromString(content);
+	// Reads the header at offset and moves offset past the whole element.
+	// offset and end are byte positions in both formats.
+	// An interned string reads as the String in the table.
+	inline ElementHeader readElementHeader(WireFormat format, const AW::byte* data, AW::uint32 end, AW::uint32& offset) {
+		ElementHeader h;
+		h.value = 0;
+		if (format == WireFormat::Text) {
+			const AW::character* s = reinterpret_cast<const AW::character*>(data);
+			AW::uint32 pos = offset / sizeof(AW::character), last = end / sizeof(AW::character);
+			AW::uint32 hexStart = pos + TypeStringLength + 2, hexEnd = findHeaderEnd(s, pos, last);
+			assert_format(hexEnd < last);
+			h.tag = textTag(StringRef(s + pos + 1, TypeStringLength));
+			h.size = parseHex(s + hexStart, hexEnd - hexStart);
+			h.offset = (hexEnd + 1) * sizeof(AW::character);
+			assert_format(h.size <= end - h.offset && h.size % sizeof(AW::character) == 0);
+			if (h.tag == BinaryTag::UInt32 || h.tag == BinaryTag::Int32)
+				h.value = parseHex(s + hexEnd + 1, h.size / sizeof(AW::character));
+			else if (h.tag == BinaryTag::Real64)
+				h.value = parseHex64(s + hexEnd + 1, h.size / sizeof(AW::character));
 		}
-		else if (type == ElementTrait<AW::uint32>::getType()) {
-			return Element<AW::uint32>::fromString(content);
+		else {
+			assert_format(offset < end);
+			h.tag = static_cast<BinaryTag>(data[offset++]);
+			if (h.tag == BinaryTag::UInt32 || h.tag == BinaryTag::Int32) {
+				h.size = sizeof(AW::uint32);
+				h.offset = offset;
+				h.value = readFixed32(data, end, offset);
+				return h;
+			}
+			if (h.tag == BinaryTag::Real64) {
+				h.size = sizeof(AW::uint64);
+				h.offset = offset;
+				h.value = readFixed64(data, end, offset);
+				return h;
+			}
+			if (h.tag == BinaryTag::Interned) {
+				AW::uint32 index = readVarint(data, end, offset);
+				return readInternedString(data, end, index);
+			}
+			h.size = readVarint(data, end, offset);
+			h.offset = offset;
+			assert_format(h.size <= end - h.offset);
+			switch (h.tag) {
+			case BinaryTag::String: case BinaryTag::Tuple: case BinaryTag::Map: case BinaryTag::Error:
+				break;
+			case BinaryTag::UInt32Array: case BinaryTag::Int32Array:
+				assert_format(h.size % sizeof(AW::uint32) == 0);
+				break;
+			case BinaryTag::Real64Array:
+				assert_format(h.size % sizeof(AW::real64) == 0);
+				break;
+			default:
+				assert_format(false);
+			}
 		}
-		else if (type == TupleTypeName) {
-			std::basic_stringstream<AW::character> ss(content);
-			return TupleType::fromStringData(ss);
+		offset = h.offset + h.size;
+		return h;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Error replies
+	// Sent instead of a return value when a call cannot be answered.
+	//////////////////////////////////////////////////////////////////////////
+	inline void encodeError(WireFormat format, const AW::string& message, ByteBuffer& out) {
+		AW::uint32 payload = sizeof(AW::character) * message.size();
+		out.resize(headerSize(format, payload) + payload);
+		AW::byte* p = out.data();
+		writeHeader(format, p, ErrorTypeName, BinaryTag::Error, payload);
+		writeChars(p, message.data(), message.size());
+	}
+	// throws the remote message if the buffer holds an error reply
+	inline void throwIfError(const AW::byte* data, AW::uint32 length) {
+		assert_format(length > 0);
+		WireFormat format = detectFormat(data);
+		AW::uint32 offset = messageBodyOffset(format, data, length);
+		auto h = readElementHeader(format, data, length, offset);
+		if (h.tag == BinaryTag::Error) {
+			AW::string message(reinterpret_cast<const AW::character*>(data + h.offset), h.size / sizeof(AW::character));
+			throw std::runtime_error(AwStringToStdString(message));
 		}
-		else if (type == MapTypeName) {
-			std::basic_stringstream<AW::character> ss(content);
-			return MapType::fromStringData(ss);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Single pass decoder over a received buffer
+	// Offsets walk the buffer once, payloads are never copied: strings are
+	// decoded as views that keep the buffer alive.
+	//////////////////////////////////////////////////////////////////////////
+	class Decoder {
+	public:
+		Decoder(std::shared_ptr<const AW::byte> buffer, AW::uint32 length) :buffer(buffer), length(length) { }
+
+		// the buffer holds exactly one element, in either wire format
+		std::shared_ptr<ElementBase> decode() {
+			assert_format(length > 0);
+			format = detectFormat(buffer.get());
+			AW::uint32 offset = messageBodyOffset(format, buffer.get(), length);
+			auto ret = decode(offset, length);
+			assert_format(offset == length);
+			return ret;
 		}
-		else {
-			assert_format(false);
-			return nullptr; // never here
+
+	private:
+		std::shared_ptr<ElementBase> decode(AW::uint32& offset, AW::uint32 end) {
+			auto h = readElementHeader(format, buffer.get(), end, offset);
+			switch (h.tag) {
+			case BinaryTag::String:
+				return std::shared_ptr<ElementBase>(new Element<AW::string>(buffer, reinterpret_cast<const AW::character*>(buffer.get() + h.offset), h.size / sizeof(AW::character)));
+			case BinaryTag::UInt32:
+				return std::shared_ptr<ElementBase>(new Element<AW::uint32>(static_cast<AW::uint32>(h.value)));
+			case BinaryTag::Int32:
+				return std::shared_ptr<ElementBase>(new Element<AW::int32>(static_cast<AW::int32>(h.value)));
+			case BinaryTag::Real64:
+				return std::shared_ptr<ElementBase>(new Element<AW::real64>(bitsReal64(h.value)));
+			case BinaryTag::UInt32Array:
+				return std::shared_ptr<ElementBase>(new ArrayType<AW::uint32>(buffer.get() + h.offset, h.size / sizeof(AW::uint32)));
+			case BinaryTag::Int32Array:
+				return std::shared_ptr<ElementBase>(new ArrayType<AW::int32>(buffer.get() + h.offset, h.size / sizeof(AW::int32)));
+			case BinaryTag::Real64Array:
+				return std::shared_ptr<ElementBase>(new ArrayType<AW::real64>(buffer.get() + h.offset, h.size / sizeof(AW::real64)));
+			case BinaryTag::Tuple: {
+				std::shared_ptr<TupleType> ret(new TupleType);
+				for (AW::uint32 pos = h.offset; pos < offset;)
+					ret->add(decode(pos, offset));
+				return ret;
+			}
+			case BinaryTag::Map: {
+				std::shared_ptr<MapType> ret(new MapType);
+				for (AW::uint32 pos = h.offset; pos < offset;) {
+					AW::uint32 keyStart = pos;
+					auto key = decode(pos, offset);
+					AW::uint32 keyEnd = pos;
+					auto val = decode(pos, offset);
+					if (format == WireFormat::Text)
+						ret->add(AW::string(reinterpret_cast<const AW::character*>(buffer.get() + keyStart), (keyEnd - keyStart) / sizeof(AW::character)), key, val);
+					else
+						ret->add(key, val);
+				}
+				return ret;
+			}
+			default:
+				assert_format(false);
+				return nullptr; // never here
+			}
 		}
+
+		std::shared_ptr<const AW::byte> buffer;
+		AW::uint32 length;
+		WireFormat format;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Create an element from string
+	// Takes the header in one read and the payload in another, then decodes
+	// the element like a received message.
+	//////////////////////////////////////////////////////////////////////////
+	static std::shared_ptr<ElementBase> fromString(std::basic_stringstream<AW::character>& ss) {
+		auto start = ss.tellg();
+		character header[TEXT_HEADER_WINDOW];
+		ss.read(header, TEXT_HEADER_WINDOW);
+		AW::uint32 got = static_cast<AW::uint32>(ss.gcount());
+		assert_format(!ss.bad());
+		// a short element at the end of the stream leaves eof set
+		ss.clear();
+
+		AW::uint32 hexStart = TypeStringLength + 2, hexEnd = findHeaderEnd(header, 0, got);
+		assert_format(hexEnd < got);
+		AW::uint32 length = parseHex(header + hexStart, hexEnd - hexStart), headerLength = hexEnd + 1;
+		AW::uint32 total = (headerLength + length) * sizeof(AW::character);
+		std::shared_ptr<AW::byte> buffer(new AW::byte[total], std::default_delete<AW::byte[]>());
+		memcpy(buffer.get(), header, headerLength * sizeof(AW::character));
+		ss.seekg(start + static_cast<std::streamoff>(headerLength));
+		if (length > 0)
+			ss.read(reinterpret_cast<AW::character*>(buffer.get()) + headerLength, length);
+		assert_format(length == 0 || static_cast<AW::uint32>(ss.gcount()) == length);
+		return Decoder(buffer, total).decode();
 	}
 }
 
@@ -0,0 +1,221 @@
+#ifndef __AW_EXECUTOR_H__
+#define __AW_EXECUTOR_H__
+
+#include "ArchDeps.h"
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Handler executor
+	// A fixed number of worker threads, apart from the IO threads, that run
+	// the calls of all sessions. Each worker has a deque of its own: it takes
+	// the newest task from its back, and a worker without work steals the
+	// oldest from the front of another, picked at random. Tasks submitted by
+	// a worker go to its own deque, others are dealt out in turn.
+	//////////////////////////////////////////////////////////////////////////
+	class Executor {
+	public:
+		typedef std::function<void()> Task;
+
+		// 0 for a thread per core
+		explicit Executor(uint32 count = 0) :next(0), queued(0), sleeping(0), stopping(false) {
+			if (count == 0)
+				count = std::max(1u, std::thread::hardware_concurrency());
+			for (uint32 i = 0; i < count; ++i)
+				workers.push_back(std::unique_ptr<Worker>(new Worker));
+			for (uint32 i = 0; i < count; ++i)
+				threads.push_back(std::thread([this, i]() -> void { run(i); }));
+		}
+		// the tasks still queued run first
+		~Executor() {
+			{
+				std::lock_guard<std::mutex> lock(idleLock);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (auto& t : threads)
+				t.join();
+		}
+
+		uint32 getThreadCount() const { return workers.size(); }
+
+		void submit(Task task) {
+			uint32 index = current().owner == this ? current().index : next++ % workers.size();
+			{
+				std::lock_guard<std::mutex> lock(workers[index]->lock);
+				workers[index]->tasks.push_back(std::move(task));
+			}
+			queued++;
+			// a worker going to sleep counts itself before it looks at queued
+			if (sleeping > 0) {
+				std::lock_guard<std::mutex> lock(idleLock);
+				wake.notify_one();
+			}
+		}
+
+		// Runs its tasks one after another in the order they were posted, on
+		// whichever workers are free; for sessions whose replies go in order
+		class Sequence {
+		public:
+			explicit Sequence(Executor& executor) :state(new State(executor)) { }
+
+			void post(Task task) const {
+				auto s = state;
+				std::lock_guard<std::mutex> lock(s->lock);
+				s->tasks.push_back(std::move(task));
+				if (!s->running) {
+					s->running = true;
+					s->executor.submit([s]() { drain(s); });
+				}
+			}
+			// From a task of a sequence: the sequence goes on with its next task
+			// only once the returned function has been called. Empty when the
+			// caller is not a task of a sequence.
+			static Task suspend() {
+				Turn* turn = current();
+				if (turn == nullptr)
+					return nullptr;
+				turn->suspended = true;
+				auto s = turn->state;
+				return [s]() { advance(s); };
+			}
+		private:
+			struct State {
+				explicit State(Executor& executor) :executor(executor), running(false) { }
+				Executor& executor;
+				std::mutex lock;
+				std::deque<Task> tasks;
+				bool running;	// a task of the sequence is queued, running or suspended
+			};
+			// the task of a sequence the calling thread runs
+			struct Turn {
+				std::shared_ptr<State> state;
+				bool suspended;
+			};
+			static Turn*& current() {
+				static thread_local Turn* turn = nullptr;
+				return turn;
+			}
+			// one task a turn, so a busy sequence does not keep a worker to itself
+			static void drain(std::shared_ptr<State> s) {
+				Task task;
+				{
+					std::lock_guard<std::mutex> lock(s->lock);
+					task = std::move(s->tasks.front());
+					s->tasks.pop_front();
+				}
+				Turn turn = { s, false };
+				current() = &turn;
+				runTask(task);
+				current() = nullptr;
+				if (!turn.suspended)
+					advance(s);
+			}
+			static void advance(std::shared_ptr<State> s) {
+				{
+					std::lock_guard<std::mutex> lock(s->lock);
+					if (s->tasks.empty()) {
+						s->running = false;
+						return;
+					}
+				}
+				s->executor.submit([s]() { drain(s); });
+			}
+
+			std::shared_ptr<State> state;
+		};
+	private:
+		struct Worker {
+			std::mutex lock;
+			std::deque<Task> tasks;
+		};
+		struct Current {
+			Executor* owner;
+			uint32 index;
+		};
+		// the worker the calling thread is, if any
+		static Current& current() {
+			static thread_local Current c = { nullptr, 0 };
+			return c;
+		}
+
+		void run(uint32 index) {
+			current() = Current{ this, index };
+			uint32 random = index + 1;
+			Task task;
+			while (true) {
+				if (take(index, random, task)) {
+					queued--;
+					runTask(task);
+					task = nullptr;
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(idleLock);
+				sleeping++;
+				wake.wait(lock, [this]() { return queued > 0 || stopping; });
+				sleeping--;
+				if (stopping && queued == 0)
+					return;
+			}
+		}
+		bool take(uint32 index, uint32& random, Task& task) {
+			{
+				auto& own = *workers[index];
+				std::lock_guard<std::mutex> lock(own.lock);
+				if (!own.tasks.empty()) {
+					task = std::move(own.tasks.back());
+					own.tasks.pop_back();
+					return true;
+				}
+			}
+			// every other worker once, from a random one on (xorshift)
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			uint32 count = workers.size();
+			uint32 start = random % count;
+			for (uint32 i = 0; i < count; ++i) {
+				uint32 victim = (start + i) % count;
+				if (victim == index)
+					continue;
+				auto& other = *workers[victim];
+				std::lock_guard<std::mutex> lock(other.lock);
+				if (!other.tasks.empty()) {
+					task = std::move(other.tasks.front());
+					other.tasks.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+		// a handler that throws costs its call, not the worker
+		static void runTask(Task& task) {
+			try {
+				task();
+			}
+			catch (std::exception& e) {
+				std::cout << e.what() << std::endl;
+			}
+		}
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::vector<std::thread> threads;
+		std::atomic<uint32> next;		// worker for the next task from outside
+		std::atomic<uint32> queued;		// tasks in all deques
+		std::atomic<uint32> sleeping;
+		std::mutex idleLock;
+		std::condition_variable wake;
+		bool stopping;
+	};
+}
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef __AW_FLAT_ELEMENTS_H__
+#define __AW_FLAT_ELEMENTS_H__
+
+#include "ArchDeps.h"
+#include "Elements.h"
+#include <vector>
+#include <memory>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Flat element tree
+	// A decoded message as one array of nodes instead of ElementBase objects.
+	// The children of a node are appended together, so they are contiguous
+	// and a container only stores where they start. A full parse lays the
+	// nodes out breadth first, a lazy one in the order they were touched.
+	//////////////////////////////////////////////////////////////////////////
+	struct FlatNode {
+		BinaryTag type;
+		AW::uint32 offset;		// payload start in the buffer
+		AW::uint32 size;		// payload bytes
+		AW::uint64 value;		// numbers only, raw bits of int32 and real64
+		AW::uint32 firstChild;	// containers only, 0 until the children are read
+		AW::uint32 childCount;	// map entries count twice, key then value
+	};
+
+	class FlatDocument;
+	class PushDecoder;
+
+	// Lightweight view of one node, copy it freely
+	class FlatCursor {
+	public:
+		FlatCursor(const FlatDocument* doc, AW::uint32 index) :doc(doc), index(index) { }
+
+		BinaryTag getType() const { return node().type; }
+		bool isString() const { return getType() == BinaryTag::String; }
+		bool isUInt32() const { return getType() == BinaryTag::UInt32; }
+		bool isTuple() const { return getType() == BinaryTag::Tuple; }
+		bool isMap() const { return getType() == BinaryTag::Map; }
+		bool isPackedArray() const { return getType() == BinaryTag::UInt32Array || getType() == BinaryTag::Int32Array || getType() == BinaryTag::Real64Array; }
+
+		/* Element count of a tuple, entry count of a map */
+		AW::uint32 size() const {
+			assert_format(isTuple() || isMap());
+			return isMap() ? children().childCount / 2 : children().childCount;
+		}
+		FlatCursor operator[](AW::uint32 i) const {
+			assert_format(isTuple() && i < children().childCount);
+			return FlatCursor(doc, node().firstChild + i);
+		}
+		FlatCursor key(AW::uint32 i) const {
+			assert_format(isMap() && i < size());
+			return FlatCursor(doc, node().firstChild + 2 * i);
+		}
+		FlatCursor value(AW::uint32 i) const {
+			assert_format(isMap() && i < size());
+			return FlatCursor(doc, node().firstChild + 2 * i + 1);
+		}
+
+		AW::uint32 asUInt32() const {
+			assert_format(isUInt32());
+			return static_cast<AW::uint32>(node().value);
+		}
+		AW::int32 asInt32() const {
+			assert_format(getType() == BinaryTag::Int32);
+			return static_cast<AW::int32>(node().value);
+		}
+		AW::real64 asReal64() const {
+			assert_format(getType() == BinaryTag::Real64);
+			return bitsReal64(node().value);
+		}
+		// Copies a packed array of T into out with one block copy,
+		// false if this node is not one (it may still be a tuple of T)
+		template<typename T>
+		bool readPackedArray(std::vector<T>& out) const {
+			return readPackedArray(out, std::integral_constant<bool, PackedTrait<T>::packed>());
+		}
+		StringRef asStringRef() const;
+		AW::string asString() const { return asStringRef().toString(); }
+		// payload byte range in the document buffer
+		AW::uint32 payloadOffset() const { return node().offset; }
+		AW::uint32 payloadSize() const { return node().size; }
+
+		template<typename T> T as() const;
+	private:
+		template<typename T>
+		bool readPackedArray(std::vector<T>& out, std::true_type) const;
+		template<typename T>
+		bool readPackedArray(std::vector<T>&, std::false_type) const { return false; }
+		const FlatNode& node() const;
+		// the node, after its children have been read
+		const FlatNode& children() const;
+
+		const FlatDocument* doc;
+		AW::uint32 index;
+	};
+
+	template<> inline AW::uint32 FlatCursor::as<AW::uint32>() const { return asUInt32(); }
+	template<> inline AW::string FlatCursor::as<AW::string>() const { return asString(); }
+	template<> inline AW::int32 FlatCursor::as<AW::int32>() const { return asInt32(); }
+	template<> inline AW::real64 FlatCursor::as<AW::real64>() const { return asReal64(); }
+
+	class FlatDocument {
+	public:
+		// Parses a message. The node array keeps its capacity between messages,
+		// so a reused document stops allocating once warmed up.
+		// A lazy document only reads the root header up front; the children of
+		// a tuple or map stay an undecoded byte range until a cursor asks for them.
+		void parse(std::shared_ptr<const AW::byte> buffer, AW::uint32 length, bool lazy = false) {
+			assert_format(length > 0);
+			this->buffer = buffer;
+			this->length = length;
+			format = detectFormat(buffer.get());
+			nodes.clear();
+
+			AW::uint32 offset = messageBodyOffset(format, buffer.get(), length);
+			nodes.push_back(readNode(offset, length));
+			assert_format(offset == length);
+			if (lazy)
+				return;
+
+			// breadth first, every container's children land right after the nodes so far
+			for (AW::uint32 i = 0; i < nodes.size(); ++i)
+				expand(i);
+		}
+
+		FlatCursor root() const { return FlatCursor(this, 0); }
+		WireFormat getFormat() const { return format; }
+		std::shared_ptr<const AW::byte> getBuffer() const { return buffer; }
+		AW::uint32 getLength() const { return length; }
+	private:
+		friend class FlatCursor;
+		friend class PushDecoder;
+
+		FlatNode readNode(AW::uint32& offset, AW::uint32 end) const {
+			auto h = readElementHeader(format, buffer.get(), end, offset);
+			FlatNode n = { h.tag, h.offset, h.size, h.value, 0, 0 };
+			return n;
+		}
+		// reads the direct children of a container, once
+		void expand(AW::uint32 index) const {
+			if ((nodes[index].type != BinaryTag::Tuple && nodes[index].type != BinaryTag::Map) || nodes[index].firstChild != 0)
+				return;
+			AW::uint32 first = nodes.size(), end = nodes[index].offset + nodes[index].size;
+			for (AW::uint32 pos = nodes[index].offset; pos < end;)
+				nodes.push_back(readNode(pos, end));
+			nodes[index].firstChild = first;
+			nodes[index].childCount = nodes.size() - first;
+			assert_format(nodes[index].type != BinaryTag::Map || nodes[index].childCount % 2 == 0);
+		}
+
+		std::shared_ptr<const AW::byte> buffer;
+		AW::uint32 length;
+		WireFormat format;
+		// grows as cursors of a lazy document walk into it
+		mutable std::vector<FlatNode> nodes;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Push decoder
+	// Builds a FlatDocument while its message is still arriving: push is
+	// called with every larger prefix of the message and decodes the elements
+	// that are complete in it, so little is left to do once the last byte is in.
+	// A container's children are added to the document as one block when the
+	// container ends, which keeps them contiguous; the root keeps node 0.
+	// A lazy decode reads the root's children only, like a lazy parse.
+	//////////////////////////////////////////////////////////////////////////
+	class PushDecoder {
+	public:
+		PushDecoder() :doc(nullptr) { }
+
+		// starts on a new message
+		void reset(FlatDocument& doc, bool lazy = false) {
+			this->doc = &doc;
+			this->lazy = lazy;
+			state = State::Start;
+			pos = 0;
+			pending.clear();
+			open.clear();
+			doc.nodes.clear();
+			doc.nodes.push_back(FlatNode());
+		}
+		// data holds the first received bytes of a length byte message
+		void push(const AW::byte* data, AW::uint32 received, AW::uint32 length) {
+			if (state == State::Start) {
+				if (received == 0)
+					return;
+				doc->format = detectFormat(data);
+				state = doc->format == WireFormat::Binary && data[0] == static_cast<AW::byte>(BinaryTag::StringTable) ? State::Table : State::Body;
+			}
+			if (state == State::Table) {
+				// interned strings are looked up in the table, it has to be all there
+				AW::uint32 tableStart = 1;
+				if (!varintComplete(data, received, tableStart))
+					return;
+				AW::uint32 bodyStart = messageBodyOffset(doc->format, data, length);
+				if (received < bodyStart)
+					return;
+				pos = bodyStart;
+				state = State::Body;
+			}
+			while (state == State::Body && step(data, received, length))
+				;
+		}
+		// hands the document the whole message, which must be decoded by now
+		void finish(std::shared_ptr<const AW::byte> buffer, AW::uint32 length) {
+			assert_format(state == State::Done);
+			doc->buffer = buffer;
+			doc->length = length;
+		}
+	private:
+		enum class State { Start, Table, Body, Done };
+		struct Open {
+			AW::uint32 end;		// end of the container's payload
+			AW::uint32 first;	// its first child in pending
+		};
+
+		// decodes one element at pos, false when it has not all arrived
+		bool step(const AW::byte* data, AW::uint32 received, AW::uint32 length) {
+			while (!open.empty() && pos == open.back().end)
+				close();
+			if (open.empty() && !pending.empty()) {
+				assert_format(pos == length);
+				doc->nodes[0] = pending[0];
+				state = State::Done;
+				return false;
+			}
+
+			BinaryTag tag;
+			AW::uint32 offset, size;
+			if (!peek(data, received, tag, offset, size))
+				return false;
+			AW::uint32 end = open.empty() ? length : open.back().end;
+			assert_format(offset <= end && size <= end - offset);
+			if ((tag == BinaryTag::Tuple || tag == BinaryTag::Map) && (!lazy || open.empty())) {
+				FlatNode n = { tag, offset, size, 0, 0, 0 };
+				pending.push_back(n);
+				open.push_back(Open{ offset + size, static_cast<AW::uint32>(pending.size()) });
+				pos = offset;
+				return true;
+			}
+			// leaves and containers left for later wait for their last byte
+			if (received < offset + size)
+				return false;
+			auto h = readElementHeader(doc->format, data, offset + size, pos);
+			FlatNode n = { h.tag, h.offset, h.size, h.value, 0, 0 };
+			pending.push_back(n);
+			return true;
+		}
+		// the open container is complete, its children join the document
+		void close() {
+			Open o = open.back();
+			open.pop_back();
+			FlatNode& n = pending[o.first - 1];
+			n.firstChild = doc->nodes.size();
+			n.childCount = pending.size() - o.first;
+			assert_format(n.type != BinaryTag::Map || n.childCount % 2 == 0);
+			doc->nodes.insert(doc->nodes.end(), pending.begin() + o.first, pending.end());
+			pending.resize(o.first);
+		}
+
+		static bool varintComplete(const AW::byte* data, AW::uint32 received, AW::uint32 offset) {
+			for (AW::uint32 i = offset; i < received && i < offset + 5; ++i) {
+				if ((data[i] & 0x80) == 0)
+					return true;
+			}
+			assert_format(received < offset + 5);
+			return false;
+		}
+		// Reads the header at pos if it has arrived, the payload may not have.
+		// offset and size are what the element takes after its header; an
+		// interned string takes nothing, it only refers to the table.
+		bool peek(const AW::byte* data, AW::uint32 received, BinaryTag& tag, AW::uint32& offset, AW::uint32& size) const {
+			if (doc->format == WireFormat::Text) {
+				const AW::character* s = reinterpret_cast<const AW::character*>(data);
+				AW::uint32 p = pos / sizeof(AW::character), last = received / sizeof(AW::character);
+				AW::uint32 hexStart = p + TypeStringLength + 2, hexEnd = findHeaderEnd(s, p, last);
+				if (hexEnd == last)
+					return false;
+				tag = textTag(StringRef(s + p + 1, TypeStringLength));
+				size = parseHex(s + hexStart, hexEnd - hexStart);
+				offset = (hexEnd + 1) * sizeof(AW::character);
+				return true;
+			}
+
+			if (pos >= received)
+				return false;
+			tag = static_cast<BinaryTag>(data[pos]);
+			offset = pos + 1;
+			if (tag == BinaryTag::UInt32 || tag == BinaryTag::Int32)
+				size = sizeof(AW::uint32);
+			else if (tag == BinaryTag::Real64)
+				size = sizeof(AW::uint64);
+			else {
+				if (!varintComplete(data, received, offset))
+					return false;
+				size = readVarint(data, received, offset);
+				if (tag == BinaryTag::Interned)
+					size = 0;
+			}
+			return true;
+		}
+
+		FlatDocument* doc;
+		bool lazy;
+		State state;
+		AW::uint32 pos;		// next header
+		std::vector<FlatNode> pending;	// decoded nodes whose container is still open
+		std::vector<Open> open;
+	};
+
+	inline const FlatNode& FlatCursor::node() const {
+		return doc->nodes[index];
+	}
+	inline const FlatNode& FlatCursor::children() const {
+		doc->expand(index);
+		return doc->nodes[index];
+	}
+	inline StringRef FlatCursor::asStringRef() const {
+		assert_format(isString());
+		return StringRef(reinterpret_cast<const AW::character*>(doc->buffer.get() + node().offset), node().size / sizeof(AW::character));
+	}
+	template<typename T>
+	inline bool FlatCursor::readPackedArray(std::vector<T>& out, std::true_type) const {
+		if (getType() != PackedTrait<T>::tag)
+			return false;
+		out.resize(node().size / sizeof(T));
+		if (!out.empty())
+			copyLittleEndian<T>(out.data(), doc->buffer.get() + node().offset, out.size());
+		return true;
+	}
+}
+
+#endif
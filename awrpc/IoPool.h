@@ -0,0 +1,62 @@
+#ifndef __AW_IO_POOL_H__
+#define __AW_IO_POOL_H__
+
+#include "ArchDeps.h"
+#include <boost/asio.hpp>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// IO thread pool
+	// A fixed number of threads running one io_service. Sessions accepted on
+	// it read and write from these threads, however many sessions there are.
+	//////////////////////////////////////////////////////////////////////////
+	class IoPool {
+	public:
+		// 0 for a thread per core
+		explicit IoPool(uint32 threads = 0)
+			:service(new boost::asio::io_service), work(new boost::asio::io_service::work(*service)),
+			threads(threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency())) { }
+
+		std::shared_ptr<boost::asio::io_service> getService() const { return service; }
+		uint32 getThreadCount() const { return threads; }
+
+		// runs the service on the pool's threads, the caller being one of them,
+		// until stop is called
+		void run() {
+			std::vector<std::thread> others;
+			for (uint32 i = 1; i < threads; ++i)
+				others.push_back(std::thread([this]() -> void { runThread(); }));
+			runThread();
+			for (auto& t : others)
+				t.join();
+		}
+		void stop() {
+			work.reset();
+			service->stop();
+		}
+	private:
+		// a handler that throws costs its session, not the thread
+		void runThread() {
+			while (true) {
+				try {
+					service->run();
+					return;
+				}
+				catch (std::exception& e) {
+					std::cout << e.what() << std::endl;
+				}
+			}
+		}
+
+		std::shared_ptr<boost::asio::io_service> service;
+		std::unique_ptr<boost::asio::io_service::work> work;
+		uint32 threads;
+	};
+}
+
+#endif
@@ -0,0 +1,499 @@
+#ifndef __AW_IO_URING_H__
+#define __AW_IO_URING_H__
+
+#include "ArchDeps.h"
+#include "AwSocket.h"
+
+#ifdef __AW_IO_URING__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// io_uring backend
+	// One ring and one thread reap the completions of every server session.
+	// Each socket keeps one multishot receive armed, and the kernel fills
+	// blocks of a registered pool (a provided buffer ring) with whatever
+	// arrives, so nothing is submitted per read. Sends are gathered sendmsg
+	// requests straight from the caller's buffers. A kernel thread polls the
+	// submission queue where allowed, so most requests need no syscall.
+	// A background read is completed by the reactor thread as soon as a block
+	// arrives for it, and its handler goes to the session's io_service, so
+	// however many sessions there are no thread waits for one of them.
+	// Sessions on a thread of their own block on a condition variable.
+	//////////////////////////////////////////////////////////////////////////
+	class UringSocket;
+
+	class UringReactor {
+	public:
+		// nullptr when the kernel has no io_uring or does not allow it.
+		// Lives as long as the process.
+		static UringReactor* global() {
+			static UringReactor* reactor = create();
+			return reactor;
+		}
+
+		const byte* block(uint32 id) const { return pool + id * URING_BUFFER_LENGTH; }
+		// a received block was read up, the kernel may fill it again
+		void recycle(uint16_t id);
+
+		// keeps a multishot receive armed on the socket until it ends
+		void arm(std::shared_ptr<UringSocket> socket);
+		// blocks until the kernel took some of the bytes, returns how many or -errno
+		int32 send(int fd, msghdr* msg);
+	private:
+		struct SendOp {
+			std::mutex mu;
+			std::condition_variable cv;
+			bool done = false;
+			int32 result = 0;
+		};
+		static constexpr uint64 SEND_TAG = 1;
+
+		UringReactor() { }
+		static UringReactor* create();
+		bool setup();
+		bool probeMultishot();
+		// the next completion, waiting for it; for setup, before run reaps them
+		io_uring_cqe reap();
+		void run();
+		void complete(const io_uring_cqe& cqe);
+
+		// a free submission entry, call with sqLock held
+		io_uring_sqe* nextSqe() {
+			for (;;) {
+				uint32 tail = *sqTail;
+				if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) < sqEntries) {
+					io_uring_sqe* sqe = &sqes[tail & sqMask];
+					memset(sqe, 0, sizeof(*sqe));
+					return sqe;
+				}
+				// full: let the kernel catch up
+				syscall(__NR_io_uring_enter, ringFd, sqPoll ? 0 : sqEntries, 0, sqPoll ? IORING_ENTER_SQ_WAKEUP : 0, nullptr, 0);
+				std::this_thread::yield();
+			}
+		}
+		// publishes the entry from nextSqe, call with sqLock held
+		void submit() {
+			__atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+			if (!sqPoll) {
+				syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0);
+				return;
+			}
+			// the poller may have gone to sleep before it saw the new tail
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+				syscall(__NR_io_uring_enter, ringFd, 0, 0, IORING_ENTER_SQ_WAKEUP, nullptr, 0);
+		}
+
+		int ringFd = -1;
+		bool sqPoll = false;
+		uint32 sqEntries = 0;
+		uint32* sqHead = nullptr;
+		uint32* sqTail = nullptr;
+		uint32 sqMask = 0;
+		uint32* sqFlags = nullptr;
+		io_uring_sqe* sqes = nullptr;
+		uint32* cqHead = nullptr;
+		uint32* cqTail = nullptr;
+		uint32 cqMask = 0;
+		io_uring_cqe* cqes = nullptr;
+		std::mutex sqLock;
+
+		io_uring_buf_ring* bufRing = nullptr;
+		byte* pool = nullptr;
+		std::mutex bufLock;
+		uint64 recycled = 0;
+		// sockets whose receive ended for want of blocks, armed again on recycle
+		std::vector<std::shared_ptr<UringSocket>> starved;
+
+		std::mutex armedLock;
+		std::unordered_map<UringSocket*, std::shared_ptr<UringSocket>> armed;
+	};
+
+	// A stream socket whose IO goes through the reactor. It keeps the socket
+	// it was made from, which owns the descriptor. Background reads finish on
+	// service.
+	class UringSocket :public SocketType {
+	public:
+		static std::shared_ptr<UringSocket> create(UringReactor* reactor, std::shared_ptr<SocketType> owner, int fd, std::shared_ptr<boost::asio::io_service> service) {
+			std::shared_ptr<UringSocket> ret(new UringSocket(reactor, owner, fd, service));
+			reactor->arm(ret);
+			return ret;
+		}
+		~UringSocket() {
+			for (auto& c : chunks)
+				reactor->recycle(c.id);
+		}
+
+		virtual uint32 readSome(byte* data, uint32 length) override {
+			std::unique_lock<std::mutex> lock(mu);
+			cv.wait(lock, [this]() { return !chunks.empty() || ended; });
+			if (chunks.empty())
+				throw std::runtime_error("disconnect");
+			return take(data, length);
+		}
+		virtual bool readSomeAsync(byte* data, uint32 length, std::function<void(uint32)> done) override {
+			std::unique_lock<std::mutex> lock(mu);
+			if (chunks.empty() && !ended) {
+				// the reactor finishes it when a block comes in
+				pending = PendingRead{ data, length, done };
+				return true;
+			}
+			uint32 count = take(data, length);
+			lock.unlock();
+			// never from the caller's stack, its handler would start the next read there
+			service->post([done, count]() { done(count); });
+			return true;
+		}
+		virtual void write(const byte* header, uint32 headerLength, const byte* data, uint32 length) override {
+			iovec parts[2] = { { const_cast<byte*>(header), headerLength }, { const_cast<byte*>(data), length } };
+			msghdr msg = {};
+			msg.msg_iov = parts;
+			msg.msg_iovlen = 2;
+			for (uint64 rest = headerLength + static_cast<uint64>(length); rest > 0;) {
+				int32 sent = reactor->send(fd, &msg);
+				if (sent == -EINTR || sent == -EAGAIN)
+					continue;
+				if (sent <= 0)
+					throw std::runtime_error("disconnect");
+				rest -= sent;
+				// skip what went out
+				while (msg.msg_iovlen > 0 && static_cast<size_t>(sent) >= msg.msg_iov->iov_len) {
+					sent -= msg.msg_iov->iov_len;
+					msg.msg_iov++;
+					msg.msg_iovlen--;
+				}
+				if (msg.msg_iovlen > 0) {
+					msg.msg_iov->iov_base = static_cast<byte*>(msg.msg_iov->iov_base) + sent;
+					msg.msg_iov->iov_len -= sent;
+				}
+			}
+		}
+		virtual void close() override {
+			// ends the armed receive, the descriptor is closed after that
+			::shutdown(fd, SHUT_RDWR);
+			owner->close();
+		}
+	private:
+		friend class UringReactor;
+		struct Chunk {
+			uint16_t id;
+			uint32 offset;
+			uint32 length;
+		};
+
+		struct PendingRead {
+			byte* data;
+			uint32 length;
+			std::function<void(uint32)> done;
+		};
+
+		UringSocket(UringReactor* reactor, std::shared_ptr<SocketType> owner, int fd, std::shared_ptr<boost::asio::io_service> service)
+			:reactor(reactor), owner(owner), fd(fd), service(service), ended(false) { }
+
+		// as much as has arrived, blocks go back as soon as they are read up;
+		// 0 once the stream ended. Call with mu held.
+		uint32 take(byte* data, uint32 length) {
+			uint32 done = 0;
+			while (done < length && !chunks.empty()) {
+				Chunk& c = chunks.front();
+				uint32 n = std::min(length - done, c.length - c.offset);
+				memcpy(data + done, reactor->block(c.id) + c.offset, n);
+				c.offset += n;
+				done += n;
+				if (c.offset == c.length) {
+					reactor->recycle(c.id);
+					chunks.pop_front();
+				}
+			}
+			return done;
+		}
+		// from the reactor thread
+		void received(uint16_t id, uint32 length) {
+			std::lock_guard<std::mutex> lock(mu);
+			chunks.push_back(Chunk{ id, 0, length });
+			cv.notify_all();
+			finishPending();
+		}
+		void end() {
+			std::lock_guard<std::mutex> lock(mu);
+			ended = true;
+			cv.notify_all();
+			finishPending();
+		}
+		// the waiting background read gets what came, call with mu held
+		void finishPending() {
+			if (pending.done == nullptr)
+				return;
+			uint32 count = take(pending.data, pending.length);
+			auto done = std::move(pending.done);
+			pending = PendingRead();
+			service->post([done, count]() { done(count); });
+		}
+
+		UringReactor* reactor;
+		std::shared_ptr<SocketType> owner;
+		int fd;
+		std::shared_ptr<boost::asio::io_service> service;
+		std::mutex mu;
+		std::condition_variable cv;
+		std::deque<Chunk> chunks;
+		bool ended;
+		PendingRead pending = PendingRead();
+		uint64 armedAt = 0;	// the reactor's recycle count when the receive was armed
+	};
+
+	inline UringReactor* UringReactor::create() {
+		UringReactor* ret = new UringReactor;
+		if (!ret->setup()) {
+			delete ret;
+			return nullptr;
+		}
+		std::thread([ret]() -> void { ret->run(); }).detach();
+		return ret;
+	}
+
+	inline bool UringReactor::setup() {
+		io_uring_params params = {};
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = URING_SQ_POLL_IDLE_MS;
+		ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+		sqPoll = ringFd >= 0;
+		if (ringFd < 0) {
+			// no polling thread for us, submit with a syscall instead
+			params = io_uring_params();
+			ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+		}
+		if (ringFd < 0)
+			return false;
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+			::close(ringFd);
+			return false;
+		}
+
+		size_t ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+		byte* rings = static_cast<byte*>(mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING));
+		void* sqeMemory = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (rings == MAP_FAILED || sqeMemory == MAP_FAILED) {
+			::close(ringFd);
+			return false;
+		}
+		sqEntries = params.sq_entries;
+		sqHead = reinterpret_cast<uint32*>(rings + params.sq_off.head);
+		sqTail = reinterpret_cast<uint32*>(rings + params.sq_off.tail);
+		sqMask = *reinterpret_cast<uint32*>(rings + params.sq_off.ring_mask);
+		sqFlags = reinterpret_cast<uint32*>(rings + params.sq_off.flags);
+		sqes = static_cast<io_uring_sqe*>(sqeMemory);
+		// entry i always sits in slot i
+		uint32* sqArray = reinterpret_cast<uint32*>(rings + params.sq_off.array);
+		for (uint32 i = 0; i < sqEntries; ++i)
+			sqArray[i] = i;
+		cqHead = reinterpret_cast<uint32*>(rings + params.cq_off.head);
+		cqTail = reinterpret_cast<uint32*>(rings + params.cq_off.tail);
+		cqMask = *reinterpret_cast<uint32*>(rings + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(rings + params.cq_off.cqes);
+
+		// the receive pool, handed to the kernel as buffer group 0
+		void* ringMemory = mmap(nullptr, URING_BUFFER_COUNT * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		void* poolMemory = mmap(nullptr, URING_BUFFER_COUNT * URING_BUFFER_LENGTH, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ringMemory == MAP_FAILED || poolMemory == MAP_FAILED) {
+			::close(ringFd);
+			return false;
+		}
+		bufRing = static_cast<io_uring_buf_ring*>(ringMemory);
+		pool = static_cast<byte*>(poolMemory);
+		io_uring_buf_reg reg = {};
+		reg.ring_addr = reinterpret_cast<uint64>(bufRing);
+		reg.ring_entries = URING_BUFFER_COUNT;
+		reg.bgid = 0;
+		if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+			::close(ringFd);
+			return false;
+		}
+		for (uint32 i = 0; i < URING_BUFFER_COUNT; ++i)
+			recycle(i);
+		if (!probeMultishot()) {
+			::close(ringFd);
+			return false;
+		}
+		return true;
+	}
+
+	// Buffer rings came with Linux 5.19 but multishot receives only with 6.0,
+	// where an older kernel would fail every session's receive right away.
+	// One receive on a socket pair tells.
+	inline bool UringReactor::probeMultishot() {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			return false;
+		{
+			std::lock_guard<std::mutex> lock(sqLock);
+			io_uring_sqe* sqe = nextSqe();
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = fds[0];
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			submit();
+		}
+		byte b = 0;
+		bool more = false;
+		if (::write(fds[1], &b, 1) == 1) {
+			// the byte with more to come, or the request refused
+			io_uring_cqe cqe = reap();
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+				recycle(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+			more = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE);
+		}
+		::close(fds[1]);
+		// a receive still armed ends with the stream
+		while (more) {
+			io_uring_cqe cqe = reap();
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+				recycle(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				break;
+		}
+		::close(fds[0]);
+		return more;
+	}
+	inline io_uring_cqe UringReactor::reap() {
+		for (;;) {
+			uint32 head = *cqHead;
+			if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+				io_uring_cqe ret = cqes[head & cqMask];
+				__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+				return ret;
+			}
+			syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		}
+	}
+
+	inline void UringReactor::recycle(uint16_t id) {
+		std::vector<std::shared_ptr<UringSocket>> waiting;
+		{
+			std::lock_guard<std::mutex> lock(bufLock);
+			uint16_t tail = bufRing->tail;
+			// not bufRing->bufs: in C++ the empty member in front of that flexible array shifts it
+			io_uring_buf& b = reinterpret_cast<io_uring_buf*>(bufRing)[tail & (URING_BUFFER_COUNT - 1)];
+			b.addr = reinterpret_cast<uint64>(pool + id * URING_BUFFER_LENGTH);
+			b.len = URING_BUFFER_LENGTH;
+			b.bid = id;
+			__atomic_store_n(&bufRing->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+			recycled++;
+			waiting.swap(starved);
+		}
+		for (auto& s : waiting)
+			arm(s);
+	}
+
+	inline void UringReactor::arm(std::shared_ptr<UringSocket> socket) {
+		{
+			std::lock_guard<std::mutex> lock(bufLock);
+			socket->armedAt = recycled;
+		}
+		{
+			std::lock_guard<std::mutex> lock(armedLock);
+			armed[socket.get()] = socket;
+		}
+		std::lock_guard<std::mutex> lock(sqLock);
+		io_uring_sqe* sqe = nextSqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = socket->fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = reinterpret_cast<uint64>(socket.get());
+		submit();
+	}
+
+	inline int32 UringReactor::send(int fd, msghdr* msg) {
+		SendOp op;
+		{
+			std::lock_guard<std::mutex> lock(sqLock);
+			io_uring_sqe* sqe = nextSqe();
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = fd;
+			sqe->addr = reinterpret_cast<uint64>(msg);
+			sqe->len = 1;
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			sqe->user_data = reinterpret_cast<uint64>(&op) | SEND_TAG;
+			submit();
+		}
+		std::unique_lock<std::mutex> lock(op.mu);
+		op.cv.wait(lock, [&op]() { return op.done; });
+		return op.result;
+	}
+
+	inline void UringReactor::run() {
+		for (;;) {
+			uint32 head = *cqHead;
+			uint32 tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			if (head == tail) {
+				syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+				continue;
+			}
+			// every completion that is there, then one store to free their slots
+			for (; head != tail; ++head)
+				complete(cqes[head & cqMask]);
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	inline void UringReactor::complete(const io_uring_cqe& cqe) {
+		if (cqe.user_data & SEND_TAG) {
+			SendOp* op = reinterpret_cast<SendOp*>(cqe.user_data & ~SEND_TAG);
+			// notified under the lock, the waiter owns op
+			std::lock_guard<std::mutex> lock(op->mu);
+			op->result = cqe.res;
+			op->done = true;
+			op->cv.notify_all();
+			return;
+		}
+
+		UringSocket* socket = reinterpret_cast<UringSocket*>(cqe.user_data);
+		if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+			socket->received(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT), cqe.res);
+		if (cqe.flags & IORING_CQE_F_MORE)
+			return;
+
+		// the receive is over: out of blocks, stopped by the kernel, or the stream ended
+		std::shared_ptr<UringSocket> self;
+		{
+			std::lock_guard<std::mutex> lock(armedLock);
+			auto it = armed.find(socket);
+			self = it->second;
+			armed.erase(it);
+		}
+		if (cqe.res == -ENOBUFS) {
+			std::unique_lock<std::mutex> lock(bufLock);
+			// blocks that came back since the socket was armed may not have been seen
+			if (recycled == self->armedAt) {
+				starved.push_back(self);
+				return;
+			}
+			lock.unlock();
+			arm(self);
+		}
+		else if (cqe.res > 0)
+			arm(self);
+		else
+			self->end();
+	}
+}
+#endif
+
+#endif
@@ -69,7 +69,7 @@ namespace AW {
 		static AW::string type() { return t("InitializedEvent"); }
 		virtual bool handle() { return true; }
 	};
-	class Looper {
+	class Looper :public std::enable_shared_from_this<Looper> {
 	public:
 		// call from other threads
 		// creation
@@ -149,7 +149,9 @@ namespace AW {
 		}
 
 		void startInNewThread() {
-			std::thread([this]() -> void { this->start(); }).detach();
+			// the thread keeps the looper alive until a QuitEvent ends it
+			auto self = shared_from_this();
+			std::thread([self]() -> void { self->start(); }).detach();
 		}
 	private:
 		Looper() { } // disable inheritance and copy
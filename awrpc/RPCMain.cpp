@@ -99,6 +99,9 @@ void RPCServerStart() {
 			}, t("searchByKeyword")))
 		});
 		awrpc = new AwRpc(rpcTable);
+		// deployed clients read only the port and connect to it again; this
+		// can go once they all stay on the first socket when it is 0
+		awrpc->setPortPerSession(true);
 		awrpc->startService();
 	}).detach();
 }
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef __AW_REPLY_CACHE_H__
+#define __AW_REPLY_CACHE_H__
+
+#include "ArchDeps.h"
+#include "Elements.h"
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Reply cache
+	// Encoded replies of one method, packed for the wire, keyed by the
+	// encoded arguments of the call. An entry lives ttl at most, and the least recently used goes
+	// when a new one would make more than capacity.
+	//////////////////////////////////////////////////////////////////////////
+	class ReplyCache {
+	public:
+		// ttl 0 for entries that only leave when evicted
+		ReplyCache(std::chrono::milliseconds ttl, uint32 capacity) :ttl(ttl), capacity(capacity), hits(0), misses(0) { }
+
+		// the stored reply, nullptr when there is none or it has expired
+		std::shared_ptr<const ByteBuffer> find(const std::string& key) {
+			std::lock_guard<std::mutex> lock(mu);
+			auto it = index.find(key);
+			if (it == index.end()) {
+				misses++;
+				return nullptr;
+			}
+			if (ttl.count() != 0 && std::chrono::steady_clock::now() >= it->second->expires) {
+				entries.erase(it->second);
+				index.erase(it);
+				misses++;
+				return nullptr;
+			}
+			entries.splice(entries.begin(), entries, it->second);
+			hits++;
+			return it->second->reply;
+		}
+		void store(const std::string& key, std::shared_ptr<const ByteBuffer> reply) {
+			if (capacity == 0)
+				return;
+			std::lock_guard<std::mutex> lock(mu);
+			auto it = index.find(key);
+			if (it != index.end()) {
+				entries.erase(it->second);
+				index.erase(it);
+			}
+			while (entries.size() >= capacity) {
+				index.erase(entries.back().key);
+				entries.pop_back();
+			}
+			entries.push_front(Entry{ key, reply, std::chrono::steady_clock::now() + ttl });
+			index[key] = entries.begin();
+		}
+
+		uint64 getHits() const { return hits; }
+		uint64 getMisses() const { return misses; }
+		uint32 size() {
+			std::lock_guard<std::mutex> lock(mu);
+			return entries.size();
+		}
+	private:
+		struct Entry {
+			std::string key;
+			std::shared_ptr<const ByteBuffer> reply;
+			std::chrono::steady_clock::time_point expires;
+		};
+
+		std::chrono::milliseconds ttl;
+		uint32 capacity;
+		std::mutex mu;
+		std::list<Entry> entries;	// most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator> index;
+		std::atomic<uint64> hits;
+		std::atomic<uint64> misses;
+	};
+}
+
+#endif
@@ -5,6 +5,15 @@
 #include "Elements.h"
 #include "AwSocket.h"
 #include "Looper.h"
+#include "Client.h"
+#include "Codec.h"
+#include "Stream.h"
+#include "ShmSocket.h"
+#include "IoUring.h"
+#include "IoPool.h"
+#include "Executor.h"
+#include "ReplyCache.h"
+#include "SingleFlight.h"
 
 #include <boost/asio.hpp>
 #include <iostream>
@@ -16,41 +25,58 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <future>
+#include <cstdio>
 
 namespace AW {
 
-	//////////////////////////////////////////////////////////////////////////
-	// Reduction (fixed)
-	//////////////////////////////////////////////////////////////////////////
-	template<typename RetValT, typename FirstArgT, typename...ArgsT>
-	class Server :public Server<RetValT, ArgsT...> {
-	public:
-		virtual std::shared_ptr<ElementBase> callFromParameters(std::shared_ptr<TupleType> params) override {
-			arg0 = Server<RetValT, FirstArgT>(nullptr, "").parse(params);
-			return Server<RetValT, ArgsT...>::callFromParameters(params);
-		}
-
-		Server(const std::function<RetValT(FirstArgT, ArgsT...)>& func, const AW::string& name)
-			:Server<RetValT, ArgsT...>([&, func](ArgsT... args) -> RetValT { return func(arg0, args...); }, name) { }
-	private:
-		FirstArgT arg0;
-	};
-
 	//////////////////////////////////////////////////////////////////////////
 	// Abstract Server, used to store server function pointers into vectors
 	//////////////////////////////////////////////////////////////////////////
 	class AbstractServerBase {
 	public:
 		virtual std::shared_ptr<ElementBase> callFromParameters(std::shared_ptr<TupleType> params) { return nullptr; }
+		virtual std::shared_ptr<ElementBase> callFromCursor(const FlatCursor& params) { return nullptr; }
+		// typed path, params is the payload range of the encoded parameter tuple
+		virtual void callFromWire(WireFormat format, const AW::byte* data, AW::uint32 begin, AW::uint32 end, ByteBuffer& reply) { }
+		// streamed replies send their own chunks, see Stream.h
+		virtual bool isStream() const { return false; }
+		virtual void streamFromWire(std::shared_ptr<Connection> conn, AW::uint32 requestId, const AW::byte* data, AW::uint32 begin, AW::uint32 end) { }
 		virtual AW::string getName() const { return t(""); }
 	};
 
+	// A handler that writes its reply elements to a StreamWriter
+	template<typename ElementT, typename...ArgsT>
+	class StreamServer :public AbstractServerBase {
+	public:
+		StreamServer(const std::function<void(StreamWriter<ElementT>&, ArgsT...)>& func, const AW::string& name) :func(func), name(name) { }
+
+		virtual bool isStream() const override { return true; }
+		virtual void streamFromWire(std::shared_ptr<Connection> conn, AW::uint32 requestId, const AW::byte* data, AW::uint32 begin, AW::uint32 end) override {
+			auto args = Codec<std::tuple<ArgsT...>>::decodePayload(conn->getFormat(), data, begin, end);
+			StreamWriter<ElementT> writer(conn, requestId);
+			auto call = [this, &writer](ArgsT... a) -> void { func(writer, a...); };
+			applyTuple(call, std::move(args));
+			writer.finish();
+		}
+		virtual AW::string getName() const override { return name; }
+	private:
+		std::function<void(StreamWriter<ElementT>&, ArgsT...)> func;
+		AW::string name;
+	};
+
 	//////////////////////////////////////////////////////////////////////////
 	// ServerRet classes
 	//////////////////////////////////////////////////////////////////////////
 	template<typename RetValT>
 	class ServerRetBase :public AbstractServerBase {
+	public:
 		virtual std::shared_ptr<ElementBase> typeToElement(RetValT v) = 0;
+
+		static void encodeReply(WireFormat format, const RetValT& v, ByteBuffer& reply) {
+			encodeValue(format, v, reply);
+		}
 	};
 
 	// Server Return for uint32,string...
@@ -68,6 +94,8 @@ namespace AW {
 	class ServerRet<std::vector<ElementType>> :public ServerRetBase<std::vector<ElementType>> {
 	public:
 		virtual std::shared_ptr<ElementBase> typeToElement(std::vector<ElementType> v) override {
+			if (auto packed = makePackedElement(v))
+				return packed;
 			std::shared_ptr<TupleType> ret(new TupleType);
 			for (auto e : v) {
 				auto elementBase = ServerRet<ElementType>().typeToElement(e);
@@ -92,75 +120,178 @@ namespace AW {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// Specialization
+	// Parameter readers
+	// One parameter from an element tree or a flat cursor. They keep no state,
+	// so a handler may be called from any number of threads at once.
+	//////////////////////////////////////////////////////////////////////////
+	// uint32, string...
+	template<typename T>
+	struct ServerParam {
+		static T fromElement(const std::shared_ptr<ElementBase>& e) {
+			auto element = dynamic_cast<Element<T>*>(e.get());
+			assert_format(element != nullptr);
+			return element->getValue();
+		}
+		static T fromCursor(const FlatCursor& param) {
+			return param.as<T>();
+		}
+	};
+	// vector
+	template<typename ElementT>
+	struct ServerParam<std::vector<ElementT>> {
+		static std::vector<ElementT> fromElement(const std::shared_ptr<ElementBase>& e) {
+			std::vector<ElementT> ret;
+			if (readPackedElement(e, ret))
+				return ret;
+			auto tuple = dynamic_cast<TupleType*>(e.get());
+			assert_format(tuple != nullptr);
+			ret.reserve(tuple->size());
+			tuple->for_each_const([&ret](std::shared_ptr<ElementBase> e) -> void {
+				ret.push_back(ServerParam<ElementT>::fromElement(e));
+			});
+			return ret;
+		}
+		static std::vector<ElementT> fromCursor(const FlatCursor& param) {
+			std::vector<ElementT> ret;
+			if (param.readPackedArray(ret))
+				return ret;
+			ret.reserve(param.size());
+			for (AW::uint32 i = 0; i < param.size(); ++i)
+				ret.push_back(ServerParam<ElementT>::fromCursor(param[i]));
+			return ret;
+		}
+	};
+	// map
+	template<typename KeyT, typename ValT>
+	struct ServerParam<std::map<KeyT, ValT>> {
+		static std::map<KeyT, ValT> fromElement(const std::shared_ptr<ElementBase>& e) {
+			auto map = dynamic_cast<MapType*>(e.get());
+			assert_format(map != nullptr);
+			std::map<KeyT, ValT> ret;
+			map->for_each_const([&ret](std::shared_ptr<ElementBase> key, std::shared_ptr<ElementBase> val) -> void {
+				ret[ServerParam<KeyT>::fromElement(key)] = ServerParam<ValT>::fromElement(val);
+			});
+			return ret;
+		}
+		static std::map<KeyT, ValT> fromCursor(const FlatCursor& param) {
+			std::map<KeyT, ValT> ret;
+			for (AW::uint32 i = 0; i < param.size(); ++i)
+				ret[ServerParam<KeyT>::fromCursor(param.key(i))] = ServerParam<ValT>::fromCursor(param.value(i));
+			return ret;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Server
+	// Every call decodes its parameters into a tuple of its own and moves them
+	// into the handler; nothing of a call is kept in the Server.
 	//////////////////////////////////////////////////////////////////////////
-	// Abstract Server Parameter Processors
-	template <typename RetValT, typename FirstArgT>
-	class ServerBase :public ServerRet<RetValT> {
+	template<typename RetValT, typename...ArgsT>
+	class Server :public ServerRet<RetValT> {
 	public:
-		ServerBase() { }
-		ServerBase(const std::function<RetValT(FirstArgT)>& func, const AW::string& name) : func(func), name(name) { }
+		Server() { }
+		Server(const std::function<RetValT(ArgsT...)>& func, const AW::string& name) :func(func), name(name) { }
 
 		virtual std::shared_ptr<ElementBase> callFromParameters(std::shared_ptr<TupleType> params) override {
-			return ServerRet<RetValT>::typeToElement(func(parse(params)));
+			return ServerRet<RetValT>::typeToElement(applyTuple(func, fromElements(*params, std::index_sequence_for<ArgsT...>())));
+		}
+		virtual std::shared_ptr<ElementBase> callFromCursor(const FlatCursor& params) override {
+			return ServerRet<RetValT>::typeToElement(applyTuple(func, fromCursor(params, std::index_sequence_for<ArgsT...>())));
+		}
+		virtual void callFromWire(WireFormat format, const AW::byte* data, AW::uint32 begin, AW::uint32 end, ByteBuffer& reply) override {
+			auto args = Codec<std::tuple<ArgsT...>>::decodePayload(format, data, begin, end);
+			ServerRetBase<RetValT>::encodeReply(format, applyTuple(func, std::move(args)), reply);
 		}
 
 		virtual AW::string getName() const override { return name; }
-		virtual FirstArgT parse(std::shared_ptr<TupleType> params) = 0;
+	private:
+		// the parameters are the last sizeof...(ArgsT) elements, in order
+		template<std::size_t...I>
+		static std::tuple<ArgsT...> fromElements(TupleType& params, std::index_sequence<I...>) {
+			assert_format(params.size() >= sizeof...(ArgsT));
+			AW::uint32 first = params.size() - sizeof...(ArgsT);
+			return std::tuple<ArgsT...>(ServerParam<ArgsT>::fromElement(params.get(first + I))...);
+		}
+		template<std::size_t...I>
+		static std::tuple<ArgsT...> fromCursor(const FlatCursor& params, std::index_sequence<I...>) {
+			assert_format(params.size() >= sizeof...(ArgsT));
+			AW::uint32 first = params.size() - sizeof...(ArgsT);
+			return std::tuple<ArgsT...>(ServerParam<ArgsT>::fromCursor(params[first + I])...);
+		}
 
-	protected:
-		FirstArgT arg;
+		std::function<RetValT(ArgsT...)> func;
 		AW::string name;
-		std::function<RetValT(FirstArgT)> func;
 	};
 
-	// Server Parameter Part(uint32, string)
-	template<typename RetValT, typename FirstArgT>
-	class Server<RetValT, FirstArgT> :public ServerBase<RetValT, FirstArgT> {
+	//////////////////////////////////////////////////////////////////////////
+	// Method table
+	// Built once over the registered methods. A method's ID is its position
+	// in the table; names are found through an open addressed hash index,
+	// IDs by position, neither walks the table. The first of several methods
+	// with one name wins, as it always did.
+	//////////////////////////////////////////////////////////////////////////
+	class MethodTable {
 	public:
-		using ServerBase<RetValT, FirstArgT>::ServerBase;
-		virtual FirstArgT parse(std::shared_ptr<TupleType> params) {
-			auto p = std::shared_ptr <Element<FirstArgT>>(new Element<FirstArgT>(*dynamic_cast<Element<FirstArgT>*>(params->pop().get())));
-			return p->getValue();
+		struct Method {
+			std::shared_ptr<AbstractServerBase> server;
+			std::shared_ptr<ReplyCache> cache;	// nullptr unless AwRpc::cacheReplies
+			std::shared_ptr<SingleFlight> flights;	// nullptr unless AwRpc::coalesceCalls
+		};
+
+		MethodTable(const std::vector<std::shared_ptr<AbstractServerBase>>& tab) {
+			for (auto& server : tab)
+				methods.push_back(Method{ server, nullptr, nullptr });
+			AW::uint32 capacity = 4;
+			while (capacity < 2 * tab.size())
+				capacity <<= 1;
+			slots.assign(capacity, Slot{ 0, 0 });
+			names.reserve(tab.size());
+			for (AW::uint32 i = 0; i < tab.size(); ++i) {
+				names.push_back(tab[i]->getName());
+				AW::uint32 h = hash(StringRef(names[i].data(), names[i].size()));
+				AW::uint32 at = h & (capacity - 1);
+				for (; slots[at].entry != 0; at = (at + 1) & (capacity - 1)) {
+					if (slots[at].hash == h && names[slots[at].entry - 1] == names[i])
+						break;
+				}
+				if (slots[at].entry == 0)
+					slots[at] = Slot{ h, i + 1 };
+			}
 		}
-	};
 
-	// Server Parameter Part(map, vector)
-	// vector
-	template<typename RetValT, typename ElementT>
-	class Server<RetValT, std::vector<ElementT>> :public ServerBase<RetValT, std::vector<ElementT>> {
-	public:
-		using ServerBase<RetValT, std::vector<ElementT>>::ServerBase;
-		virtual std::vector<ElementT> parse(std::shared_ptr<TupleType> params) {
-			auto p = std::shared_ptr <TupleType>(new TupleType(*dynamic_cast<TupleType*>(params->pop().get())));
-			std::vector<ElementT> ret;
-			p->for_each_const([&ret](std::shared_ptr<ElementBase> e) -> void {
-				std::shared_ptr<TupleType> tt(new TupleType);
-				tt->add(e);
-				ret.push_back(Server<RetValT, ElementT>().parse(tt));
-			});
-			return ret;
+		// nullptr when there is no such method
+		const Method* find(const StringRef& name) const {
+			AW::uint32 h = hash(name), mask = slots.size() - 1;
+			for (AW::uint32 at = h & mask; slots[at].entry != 0; at = (at + 1) & mask) {
+				if (slots[at].hash == h && name == names[slots[at].entry - 1])
+					return &methods[slots[at].entry - 1];
+			}
+			return nullptr;
 		}
-	};
-
-	// map
-	template<typename RetValT, typename KeyT, typename ValT>
-	class Server<RetValT, std::map<KeyT, ValT>> :public ServerBase <RetValT, std::map<KeyT, ValT>> {
-	public:
-		using ServerBase<RetValT, std::map<KeyT, ValT>>::ServerBase;
-
-		virtual std::map<KeyT, ValT> parse(std::shared_ptr<TupleType> params) {
-			auto p = std::shared_ptr <MapType>(new MapType(*dynamic_cast<MapType*>(params->pop().get())));
-			std::map<KeyT, ValT> ret;
-			p->for_each_const([&ret](std::shared_ptr<ElementBase> key, std::shared_ptr<ElementBase> val) -> void {
-				std::shared_ptr<TupleType> tt(new TupleType);
-				tt->add(key);
-				tt->add(val);
-				ret[Server<RetValT, KeyT>().parse(tt)] =
-					Server<RetValT, ValT>().parse(tt);
-			});
-			return ret;
+		const Method* find(AW::uint32 id) const {
+			return id < methods.size() ? &methods[id] : nullptr;
+		}
+		Method* find(const StringRef& name) {
+			return const_cast<Method*>(static_cast<const MethodTable*>(this)->find(name));
+		}
+		// in ID order
+		const std::vector<AW::string>& getNames() const { return names; }
+	private:
+		struct Slot {
+			AW::uint32 hash;
+			AW::uint32 entry;	// table index + 1, 0 when free
+		};
+		// FNV-1a
+		static AW::uint32 hash(const StringRef& name) {
+			AW::uint32 h = 2166136261u;
+			for (AW::uint32 i = 0; i < name.size; ++i)
+				h = (h ^ static_cast<AW::uint32>(name.data[i])) * 16777619u;
+			return h;
 		}
+
+		std::vector<Method> methods;
+		std::vector<AW::string> names;
+		std::vector<Slot> slots;
 	};
 
 	//////////////////////////////////////////////////////////////////////////
@@ -169,130 +300,653 @@ namespace AW {
 	using boost::asio::ip::tcp;
 	class AwRpc {
 	public:
-		AwRpc(AW::uint32 port, std::vector<std::shared_ptr<AbstractServerBase>>&& tab) :port(port), tab(tab), comPort(COMMUNICATION_PORT_START) { }
-		explicit AwRpc(std::vector<std::shared_ptr<AbstractServerBase>> tab) :port(DEFAULT_PORT), tab(tab), comPort(COMMUNICATION_PORT_START){ }
+		AwRpc(AW::uint32 port, std::vector<std::shared_ptr<AbstractServerBase>>&& tab) :port(port), comPort(0), tab(tab) { }
+		explicit AwRpc(std::vector<std::shared_ptr<AbstractServerBase>> tab) :port(DEFAULT_PORT), comPort(0), tab(tab) { }
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+		// same host clients only, no TCP ports at all
+		AwRpc(std::vector<std::shared_ptr<AbstractServerBase>> tab, const boost::asio::local::stream_protocol::endpoint& endpoint)
+			:port(0), comPort(0), tab(tab), localPath(endpoint.path()) { }
+#endif
 
 		void startService() {
-			boost::asio::io_service service;
-			std::shared_ptr<tcp::acceptor> acc(new tcp::acceptor(service, tcp::endpoint(tcp::v4(), DEFAULT_PORT)));
-
-			while (true) {
-				socket = std::shared_ptr<boost::asio::ip::tcp::socket>(new tcp::socket(service));
-				acc->accept(*socket);
-				std::cout << AwStringToStdString(t("New Connection")) << std::endl;
-
-				std::basic_stringstream<character> ss;
-				AW::string comPortStr;
-				unsigned short pt = comPort;
-				ss << comPort;
-				ss >> comPortStr;
-				comPort++;
-
-				std::thread([pt, this]() -> void {
-					boost::asio::io_service service;
-					std::shared_ptr<tcp::acceptor> acc(new tcp::acceptor(service, tcp::endpoint(tcp::v4(), pt)));
-					auto socket = std::shared_ptr<boost::asio::ip::tcp::socket>(new tcp::socket(service));
-
-					acc->accept(*socket);
-					auto looper = Looper::createLooper();
-					looper->startInNewThread();
-
-					while (true) {
-						try {
-							receiveFunctionCall(socket, tab, looper);
-						}
-						catch (std::exception& e) {
-							std::cout << e.what() << std::endl;
-							break;
-						}
-					}
-					std::cout << "Client Down" << std::endl;
-				}).detach();
-				
-				AwSocket::sendString(socket, comPortStr);
-
-				//std::this_thread::sleep_for(std::chrono::milliseconds(500));
-
-				socket->close();
-				std::cout << "server close" << std::endl;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+			if (!localPath.empty()) {
+				startLocalService();
+				return;
 			}
+#endif
+			// accepts and serves every session from the pool until stopService
+			pool.reset(new IoPool(threadCount));
+			handlers.reset(new Executor(handlerThreadCount));
+			streams.reset(new Executor(streamThreadCount));
+			std::shared_ptr<tcp::acceptor> acc(new tcp::acceptor(*pool->getService(), tcp::endpoint(tcp::v4(), port)));
+			acceptTcp(acc);
+			pool->run();
 			std::cout << "server Down!" << std::endl;
 		}
 		void startServiceAsync() {
 			std::thread([this]() -> void { this->startService(); }).detach();
 		}
 		//bool isServerUp() const { return serverUp; }
-		std::shared_ptr<boost::asio::ip::tcp::socket> getSocket() const { return socket; }
+		std::shared_ptr<SocketType> getSocket() const { return socket; }
+		// for sessions accepted from now on
+		void setMaxMessageLength(uint32 length) { maxMessageLength = length; }
+		// for clients that cannot stay on the first socket: each session gets
+		// a port of its own, from MAX_PORTS ports that are reused in turn;
+		// for sessions accepted from now on
+		void setPortPerSession(bool enabled) { portPerSession = enabled; }
+		// threads reading and writing for all sessions, 0 for one per core; before startService
+		void setThreadCount(uint32 threads) { threadCount = threads; }
+		// threads running the calls of all sessions, 0 for one per core; before startService
+		void setHandlerThreadCount(uint32 threads) { handlerThreadCount = threads; }
+		// threads running the stream handlers of all sessions, 0 for one per
+		// core; before startService
+		void setStreamThreadCount(uint32 threads) { streamThreadCount = threads; }
+		// Replies of method are kept and sent again to calls with the same
+		// arguments, for ttl at most and capacity replies at most. Only for
+		// methods whose reply depends on their arguments alone; before startService.
+		void cacheReplies(const AW::string& method, std::chrono::milliseconds ttl, uint32 capacity) {
+			auto entry = tab.find(StringRef(method.data(), method.size()));
+			if (entry == nullptr || entry->server->isStream())
+				throw std::runtime_error("cannot cache replies of " + AwStringToStdString(method));
+			entry->cache.reset(new ReplyCache(ttl, capacity));
+		}
+		// hit and miss counts are kept there; nullptr for methods without cache
+		std::shared_ptr<ReplyCache> getReplyCache(const AW::string& method) const {
+			auto entry = tab.find(StringRef(method.data(), method.size()));
+			return entry != nullptr ? entry->cache : nullptr;
+		}
+		// A call of method with the arguments of one that is running gets the
+		// reply of that one instead of running too. Only for methods whose
+		// reply depends on their arguments alone; before startService.
+		void coalesceCalls(const AW::string& method) {
+			auto entry = tab.find(StringRef(method.data(), method.size()));
+			if (entry == nullptr || entry->server->isStream())
+				throw std::runtime_error("cannot coalesce calls of " + AwStringToStdString(method));
+			entry->flights.reset(new SingleFlight);
+		}
+		// nullptr for methods whose calls are not coalesced
+		std::shared_ptr<SingleFlight> getSingleFlight(const AW::string& method) const {
+			auto entry = tab.find(StringRef(method.data(), method.size()));
+			return entry != nullptr ? entry->flights : nullptr;
+		}
+		void stopService() {
+			if (pool != nullptr)
+				pool->stop();
+		}
 
-		static void receiveFunctionCall(std::shared_ptr<boost::asio::ip::tcp::socket> socket, const std::vector<std::shared_ptr<AbstractServerBase>>& tab, std::shared_ptr<Looper> looper = nullptr) {
+		// Runs a call, or queues it; stream tells that the call may wait a long
+		// time for credit
+		typedef std::function<void(Event* e, bool stream)> PostFunc;
+
+		static void receiveFunctionCall(std::shared_ptr<SocketType> socket, const MethodTable& tab, const PostFunc& post = nullptr) {
+			receiveFunctionCall(std::shared_ptr<Connection>(new Connection(socket)), tab, post);
+		}
+		static void receiveFunctionCall(std::shared_ptr<Connection> conn, const MethodTable& tab, const PostFunc& post = nullptr) {
 			// Lock the socket
 			//////////////////////////////////////////////////////////////////////////
 			// receive here
-			std::basic_stringstream<AW::character> ss(AwSocket::receiveString(socket));
-			//std::cout << AwStringToStdString(ss.str()) << std::endl;
-			auto funcTuple = std::shared_ptr<TupleType>(new TupleType(*dynamic_cast<TupleType*>(fromString(ss).get())));
-			auto funcName = funcTuple->get<Element<AW::string>>(0).getValue();
-			auto params = std::shared_ptr<TupleType>(new TupleType(funcTuple->get<TupleType>(1)));
-
-			auto funcClosure = [&tab, funcName, params, &socket](const Event&) -> bool {
-				for (auto f : tab) {
-					if (f->getName() == funcName) {
-						auto ret = f->callFromParameters(params);
-						std::this_thread::sleep_for(std::chrono::milliseconds(10));
-
-						//////////////////////////////////////////////////////////////////////////
-						// send here
-						AwSocket::sendString(socket, ret->toString());
-						break;
+			// the handler may still be reading a document while the next request arrives.
+			// Lazy: only the name is decoded here, the parameters stay raw bytes
+			auto doc = conn->leaseDocument();
+			uint32 requestId = 0;
+			AwSocket::receiveDocument(conn, *doc, true, requestId);
+			dispatchCall(conn, doc, tab, post, requestId);
+		}
+		// Runs the call whose request is in doc, or queues it with post when
+		// there is one. The reply goes out with requestId.
+		static void dispatchCall(std::shared_ptr<Connection> conn, std::shared_ptr<FlatDocument> doc, const MethodTable& tab, const PostFunc& post, uint32 requestId = 0) {
+			auto method = doc->root()[0];
+			auto params = doc->root()[1];
+
+			// a method ID agreed at handshake, or the name
+			const MethodTable::Method* entry = nullptr;
+			if (method.isUInt32()) {
+				entry = tab.find(method.asUInt32());
+				if (entry == nullptr)
+					sendError(conn, t("no such method: #") + StdStringToAwString(std::to_string(method.asUInt32())), requestId);
+				else
+					dispatchMethod(conn, doc, *entry, params, post, requestId);
+				return;
+			}
+			auto funcName = method.asStringRef();
+
+			// handshake, answered in the old format before switching
+			if (funcName == HELLO_FUNC_NAME) {
+				auto features = params[0].asUInt32() & conn->getOfferedFeatures();
+				// request IDs go in the frame header
+				if (!(features & FeatureFraming))
+					features &= ~FeatureRequestIds;
+				AwSocket::sendElement(conn, std::shared_ptr<ElementBase>(new Element<AW::uint32>(features)));
+#ifdef __AW_SHM__
+				if (features & FeatureSharedMemory)
+					conn->setSocket(ShmSocket::accept(conn->getSocket()));
+#endif
+				conn->setFeatures(features);
+				return;
+			}
+			// a stream reader made room, nothing is answered
+			if (funcName == CREDIT_FUNC_NAME) {
+				conn->grantCredit(params[0].asUInt32());
+				return;
+			}
+			// the names in ID order, for clients that call by ID
+			if (funcName == METHODS_FUNC_NAME) {
+				auto& names = tab.getNames();
+				std::lock_guard<std::mutex> lock(conn->getWriteLock());
+				auto& reply = conn->getWriteBuffer();
+				encodeValue(conn->getFormat(), names, reply);
+				AwSocket::sendMessage(conn, reply.data(), reply.size(), requestId);
+				return;
+			}
+
+			entry = tab.find(funcName);
+			// unknown methods are answered right away, their parameters are never read
+			if (entry == nullptr) {
+				sendError(conn, t("no such method: ") + funcName.toString(), requestId);
+				return;
+			}
+			dispatchMethod(conn, doc, *entry, params, post, requestId);
+		}
+		static void sendError(std::shared_ptr<Connection> conn, const AW::string& message, uint32 requestId) {
+			std::lock_guard<std::mutex> lock(conn->getWriteLock());
+			auto& reply = conn->getWriteBuffer();
+			encodeError(conn->getFormat(), message, reply);
+			AwSocket::sendMessage(conn, reply.data(), reply.size(), requestId);
+		}
+		// the key of a call in a reply cache or single flight: the formats, the
+		// features the stored reply is packed for and the encoded parameters.
+		// false for requests with interned strings, their bytes mean nothing
+		// without the message's table
+		static bool cacheKey(std::shared_ptr<Connection> conn, const FlatDocument& doc, const FlatCursor& params, std::string& key) {
+			const AW::byte* data = doc.getBuffer().get();
+			if (messageBodyOffset(doc.getFormat(), data, doc.getLength()) != 0)
+				return false;
+			key.assign(1, static_cast<char>(conn->getFormat()));
+			key.push_back(static_cast<char>(doc.getFormat()));
+			key.push_back(static_cast<char>(conn->getFeatures() & (FeatureInterning | FeatureCompression)));
+			key.append(reinterpret_cast<const char*>(data + params.payloadOffset()), params.payloadSize());
+			return true;
+		}
+		static void dispatchMethod(std::shared_ptr<Connection> conn, std::shared_ptr<FlatDocument> doc, const MethodTable::Method& entry, FlatCursor params, const PostFunc& post, uint32 requestId) {
+			auto func = entry.server;
+			auto cache = entry.cache;
+			auto flights = entry.flights;
+
+			auto streamClosure = [func, doc, params, conn, requestId](const Event&) -> bool {
+				try {
+					func->streamFromWire(conn, requestId, doc->getBuffer().get(), params.payloadOffset(), params.payloadOffset() + params.payloadSize());
+				}
+				catch (std::exception& e) {
+					// ends the stream for the reader, unless the session is gone too
+					try {
+						std::lock_guard<std::mutex> lock(conn->getWriteLock());
+						auto& reply = conn->getWriteBuffer();
+						encodeError(conn->getFormat(), StdStringToAwString(e.what()), reply);
+						AwSocket::sendMessage(conn, reply.data(), reply.size(), requestId);
+					}
+					catch (std::exception&) { }
+				}
+				conn->endStream();
+				return true;
+			};
+			auto funcClosure = [func, cache, flights, doc, params, conn, requestId](const Event&) -> bool {
+				// a cached reply is sent as it was stored, interned and compressed
+				// already, here rather than on arrival so that it keeps its place
+				// among the replies
+				std::string key;
+				bool keyed = (cache != nullptr || flights != nullptr) && cacheKey(conn, *doc, params, key);
+				if (keyed && cache != nullptr) {
+					if (auto hit = cache->find(key)) {
+						try {
+							AwSocket::sendPacked(conn, hit->data(), hit->size(), requestId);
+						}
+						catch (std::exception&) { }
+						return true;
+					}
+				}
+				// the same call running already answers this one too. Where
+				// replies go in order the session's next call waits for it, and
+				// a call that is not on a sequence waits itself.
+				std::shared_ptr<SingleFlight::Flight> flight;
+				if (keyed && flights != nullptr) {
+					bool leader = false;
+					flight = flights->begin(key, leader);
+					if (!leader) {
+						Executor::Task resume;
+						if (!(conn->getFeatures() & FeatureRequestIds))
+							resume = Executor::Sequence::suspend();
+						std::shared_ptr<const ByteBuffer> shared;
+						if (resume == nullptr && !(conn->getFeatures() & FeatureRequestIds))
+							shared = flight->wait();
+						else
+							shared = flight->join(conn, requestId, resume);
+						if (shared != nullptr) {
+							try {
+								AwSocket::sendPacked(conn, shared->data(), shared->size(), requestId);
+							}
+							catch (std::exception&) { }
+							if (resume != nullptr)
+								resume();
+						}
+						return true;
 					}
 				}
+				// replies go out in the connection's format whatever the request used.
+				// Each thread encodes into a buffer of its own, calls of one
+				// connection may run side by side.
+				static thread_local ByteBuffer reply;
+				bool failed = false;
+				try {
+					func->callFromWire(conn->getFormat(), doc->getBuffer().get(), params.payloadOffset(), params.payloadOffset() + params.payloadSize(), reply);
+				}
+				catch (std::exception& e) {
+					encodeError(conn->getFormat(), StdStringToAwString(e.what()), reply);
+					failed = true;
+				}
+				// a reply that is kept or shared is packed once for every
+				// connection with the key. An error goes to the calls that
+				// joined but is not kept, the next call tries again.
+				std::shared_ptr<ByteBuffer> packed;
+				if (flight != nullptr || (cache != nullptr && keyed && !failed)) {
+					packed.reset(new ByteBuffer);
+					AwSocket::packMessage(conn, reply.data(), reply.size(), *packed);
+					if (cache != nullptr && !failed)
+						cache->store(key, packed);
+					if (flight != nullptr)
+						flights->finish(key, flight, packed);
+				}
+
+				//////////////////////////////////////////////////////////////////////////
+				// send here; a peer that is gone ends the session on the receiving side
+				try {
+					if (packed != nullptr)
+						AwSocket::sendPacked(conn, packed->data(), packed->size(), requestId);
+					else
+						AwSocket::sendMessage(conn, reply.data(), reply.size(), requestId);
+				}
+				catch (std::exception&) { }
 				return true;
 			};
-			if (looper == nullptr) {
+			// each running stream may hold a stream thread while it waits for credit
+			if (func->isStream() && !conn->startStream()) {
+				sendError(conn, t("too many streams at once"), requestId);
+				return;
+			}
+			if (post == nullptr) {
 				Event e;
-				funcClosure(e);
+				func->isStream() ? streamClosure(e) : funcClosure(e);
+			}
+			else if (func->isStream())
+				post(new Event(streamClosure), true);
+			else
+				post(new Event(funcClosure), false);
+		}
+
+	private:
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+		void startLocalService() {
+			pool.reset(new IoPool(threadCount));
+			handlers.reset(new Executor(handlerThreadCount));
+			streams.reset(new Executor(streamThreadCount));
+			// a socket file left by an earlier run would make the bind fail
+			std::remove(localPath.c_str());
+			std::shared_ptr<boost::asio::local::stream_protocol::acceptor> acc(
+				new boost::asio::local::stream_protocol::acceptor(*pool->getService(), boost::asio::local::stream_protocol::endpoint(localPath)));
+			acceptLocal(acc);
+			pool->run();
+		}
+		void acceptLocal(std::shared_ptr<boost::asio::local::stream_protocol::acceptor> acc) {
+			std::shared_ptr<LocalSocket> client(new LocalSocket(pool->getService()));
+			acc->async_accept(client->get(), [this, acc, client](const boost::system::error_code& ec) {
+				if (ec == boost::asio::error::operation_aborted)
+					return;
+				if (!ec) {
+					socket = client;
+					std::cout << AwStringToStdString(t("New Connection")) << std::endl;
+					// port 0: the session goes on over this socket
+					std::basic_stringstream<character> ss;
+					ss << 0 << t(" ") << LOCAL_FEATURES;
+					try {
+						AwSocket::sendString(client, ss.str());
+						client->setBackground(true);
+						startSession(newConnection(client, LOCAL_FEATURES));
+					}
+					catch (std::exception& e) {
+						std::cout << e.what() << std::endl;
+					}
+				}
+				acceptLocal(acc);
+			});
+		}
+#endif
+		void acceptTcp(std::shared_ptr<tcp::acceptor> acc) {
+			std::shared_ptr<TcpSocket> client(new TcpSocket(pool->getService()));
+			acc->async_accept(client->get(), [this, acc, client](const boost::system::error_code& ec) {
+				if (ec == boost::asio::error::operation_aborted)
+					return;
+				if (!ec) {
+					socket = client;
+					std::cout << AwStringToStdString(t("New Connection")) << std::endl;
+					try {
+						if (portPerSession)
+							startLegacySession(client);
+						else {
+							// port 0: the session goes on over this socket
+							std::basic_stringstream<character> ss;
+							ss << 0 << t(" ") << SUPPORTED_FEATURES;
+							AwSocket::sendString(client, ss.str());
+							auto session = sessionSocket(client, pool->getService());
+							if (session == client)
+								client->setBackground(true);
+							startSession(newConnection(session, SUPPORTED_FEATURES));
+						}
+					}
+					catch (std::exception& e) {
+						std::cout << e.what() << std::endl;
+					}
+				}
+				acceptTcp(acc);
+			});
+		}
+		std::shared_ptr<Connection> newConnection(std::shared_ptr<SocketType> socket, uint32 offered) {
+			std::shared_ptr<Connection> conn(new Connection(socket));
+			conn->setOfferedFeatures(offered);
+			conn->setMaxMessageLength(maxMessageLength);
+			return conn;
+		}
+
+		//////////////////////////////////////////////////////////////////////////
+		// A session served by the pool
+		// Reads are started in the background and the messages a read completed
+		// are handled on the pool thread it finished on; the calls they hold go
+		// to the handler executor, see postCalls.
+		// A transport that cannot read in the background, and a session that
+		// moves to shared memory, go on with serveSession on a thread instead.
+		//////////////////////////////////////////////////////////////////////////
+		class AsyncSession :public std::enable_shared_from_this<AsyncSession> {
+		public:
+			AsyncSession(AwRpc* rpc, std::shared_ptr<Connection> conn) :rpc(rpc), conn(conn), calls(*rpc->handlers), post(rpc->postCalls(conn, calls)) { }
+
+			void read() {
+				auto self = shared_from_this();
+				uint32 size = 0;
+				byte* space = nullptr;
+				try {
+					space = AwSocket::prepareRead(conn, size);
+				}
+				catch (std::exception& e) {
+					end(e.what());
+					return;
+				}
+				if (!conn->getSocket()->readSomeAsync(space, size, [self](uint32 count) { self->received(count); }))
+					toThread(nullptr);
+			}
+		private:
+			void received(uint32 count) {
+				auto self = shared_from_this();
+				try {
+					if (count == 0)
+						throw std::runtime_error("disconnect");
+					AwSocket::commitRead(conn, count);
+					uint32 length = 0, requestId = 0;
+					while (auto message = AwSocket::nextMessage(conn, length, requestId)) {
+						// lazy: only the name is decoded here, the parameters stay raw bytes
+						auto doc = conn->leaseDocument();
+						doc->parse(message, length, true);
+						if (movesToSharedMemory(*doc)) {
+							// its handshake blocks, and the session ends up on a thread anyway
+							toThread(doc);
+							return;
+						}
+						dispatchCall(conn, doc, rpc->tab, post, requestId);
+					}
+				}
+				catch (std::exception& e) {
+					end(e.what());
+					return;
+				}
+				read();
 			}
-			else 
-				looper->putEvent(new Event(funcClosure));
+			bool movesToSharedMemory(const FlatDocument& doc) const {
+#ifdef __AW_SHM__
+				return doc.root()[0].isString() && doc.root()[0].asStringRef() == HELLO_FUNC_NAME && (doc.root()[1][0].asUInt32() & conn->getOfferedFeatures() & FeatureSharedMemory) != 0;
+#else
+				return false;
+#endif
+			}
+			// first is a request read here and not dispatched yet
+			void toThread(std::shared_ptr<FlatDocument> first) {
+				auto self = shared_from_this();
+				// after the calls still queued in order
+				calls.post([self, first]() {
+					std::thread([self, first]() -> void {
+						try {
+							if (first != nullptr)
+								dispatchCall(self->conn, first, self->rpc->tab, nullptr);
+						}
+						catch (std::exception& e) {
+							std::cout << e.what() << std::endl;
+							self->conn->getSocket()->close();
+							return;
+						}
+						self->rpc->serveSession(self->conn);
+					}).detach();
+				});
+			}
+			void end(const char* what) {
+				std::cout << what << std::endl;
+				// streams waiting for credit that will not come give up, the
+				// socket closes once the calls queued in order have answered
+				conn->cancelCredit();
+				auto self = shared_from_this();
+				calls.post([self]() {
+					self->conn->getSocket()->close();
+					std::cout << "Client Down" << std::endl;
+				});
+			}
+
+			AwRpc* rpc;
+			std::shared_ptr<Connection> conn;
+			Executor::Sequence calls;
+			PostFunc post;
+		};
+		// The calls of a session go to the handler executor: in order on its
+		// sequence, or to any worker when the client tells replies apart by
+		// request ID. Streams wait for credit as long as their reader is
+		// behind, so they run on an executor of their own and never hold up calls.
+		PostFunc postCalls(std::shared_ptr<Connection> conn, Executor::Sequence calls) {
+			Executor* executor = handlers.get();
+			Executor* streamExecutor = streams.get();
+			return [conn, calls, executor, streamExecutor](Event* e, bool stream) {
+				std::shared_ptr<Event> ev(e);
+				if (stream)
+					streamExecutor->submit([ev]() { ev->execute(); });
+				else if (conn->getFeatures() & FeatureRequestIds)
+					executor->submit([ev]() { ev->execute(); });
+				else
+					calls.post([ev]() { ev->execute(); });
+			};
+		}
+		void startSession(std::shared_ptr<Connection> conn) {
+			std::shared_ptr<AsyncSession> session(new AsyncSession(this, conn));
+			session->read();
+		}
+
+		// "<port> <features>", the client connects again to that port. The
+		// port is given up when it has not within LEGACY_ACCEPT_TIMEOUT_MS.
+		void startLegacySession(std::shared_ptr<TcpSocket> client) {
+			uint32 pt = COMMUNICATION_PORT_START + comPort;
+			comPort = (comPort + 1) % MAX_PORTS;
+			// listening before the client hears the port, so it cannot come too early
+			auto service = pool->getService();
+			std::shared_ptr<tcp::acceptor> acc;
+			try {
+				acc.reset(new tcp::acceptor(*service, tcp::endpoint(tcp::v4(), pt)));
+			}
+			catch (std::exception& e) {
+				std::cout << e.what() << std::endl;
+				client->close();
+				return;
+			}
+			std::basic_stringstream<character> ss;
+			ss << pt << t(" ") << SUPPORTED_FEATURES;
+			AwSocket::sendString(client, ss.str());
+			client->close();
+
+			// the acceptor is only touched on the strand, the handlers may run on any pool thread
+			std::shared_ptr<boost::asio::io_service::strand> strand(new boost::asio::io_service::strand(*service));
+			std::shared_ptr<boost::asio::steady_timer> deadline(new boost::asio::steady_timer(*service));
+			std::shared_ptr<TcpSocket> socket(new TcpSocket(service));
+			strand->dispatch([this, strand, deadline, acc, socket]() {
+				acc->async_accept(socket->get(), strand->wrap([this, deadline, acc, socket](const boost::system::error_code& ec) {
+					deadline->cancel();
+					acc->close();
+					if (ec) {
+						std::cout << (ec == boost::asio::error::operation_aborted ? "client did not connect again" : ec.message()) << std::endl;
+						return;
+					}
+					try {
+						auto session = sessionSocket(socket, pool->getService());
+						if (session == socket)
+							socket->setBackground(true);
+						startSession(newConnection(session, SUPPORTED_FEATURES));
+					}
+					catch (std::exception& e) {
+						std::cout << e.what() << std::endl;
+						socket->close();
+					}
+				}));
+				deadline->expires_from_now(std::chrono::milliseconds(LEGACY_ACCEPT_TIMEOUT_MS));
+				deadline->async_wait(strand->wrap([acc](const boost::system::error_code& ec) {
+					// cancels the accept, whose handler frees the port
+					if (!ec)
+						acc->close();
+				}));
+			});
+		}
+		// the transport a TCP session runs on, background reads finish on service
+		static std::shared_ptr<SocketType> sessionSocket(std::shared_ptr<TcpSocket> socket, std::shared_ptr<boost::asio::io_service> service) {
+#ifdef __AW_IO_URING__
+			if (auto reactor = UringReactor::global())
+				return UringSocket::create(reactor, socket, socket->get().native_handle(), service);
+#else
+			(void)service;
+#endif
+			return socket;
+		}
+		// a session on a thread of its own, reading blocking; its calls run
+		// on the handler executor like those of the pool's sessions
+		void serveSession(std::shared_ptr<Connection> conn) {
+			Executor::Sequence calls(*handlers);
+			auto post = postCalls(conn, calls);
+
+			while (true) {
+				try {
+					receiveFunctionCall(conn, tab, post);
+				}
+				catch (std::exception& e) {
+					std::cout << e.what() << std::endl;
+					break;
+				}
+			}
+			// let the calls queued in order finish; streams waiting for credit
+			// that will not come give up
+			conn->cancelCredit();
+			std::shared_ptr<std::promise<void>> drained(new std::promise<void>);
+			auto done = drained->get_future();
+			calls.post([drained]() { drained->set_value(); });
+			done.wait();
+			conn->getSocket()->close();
+			std::cout << "Client Down" << std::endl;
 		}
 
 		uint32 port;
-		uint32 comPort;
-		std::vector<std::shared_ptr<AbstractServerBase>> tab;
-		std::shared_ptr<boost::asio::ip::tcp::socket> socket;
+		uint32 comPort;		// next legacy session port, above COMMUNICATION_PORT_START
+		uint32 maxMessageLength = DEFAULT_MAX_MESSAGE_LENGTH;
+		std::atomic<bool> portPerSession{ false };
+		uint32 threadCount = 0;
+		uint32 handlerThreadCount = 0;
+		uint32 streamThreadCount = DEFAULT_STREAM_THREAD_COUNT;
+		std::unique_ptr<IoPool> pool;
+		std::unique_ptr<Executor> handlers;
+		std::unique_ptr<Executor> streams;
+		MethodTable tab;
+		std::shared_ptr<SocketType> socket;
+		std::string localPath;
 		std::mutex muSocket;
 
 		//Looper* looper;
 		//bool serverUp = false;
 	};
 
-	// Client Connection helper function
-	void clientStart(std::string addr, std::function<void(std::shared_ptr<tcp::socket>)> callback) {
-		boost::asio::io_service io_service;
-		std::shared_ptr<tcp::socket> dispatchSocket(new tcp::socket(io_service));
-		dispatchSocket->connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(addr), DEFAULT_PORT));
-
-		AW::string portStr = AwSocket::receiveString(dispatchSocket);
-		uint32 port;
+	// Client Connection helper functions
+	// "<port> <features>" from the dispatch socket, old servers send the port only
+	inline void parseHandshake(const AW::string& str, uint32& port, uint32& features) {
 		std::basic_stringstream<AW::character> ss;
-		ss << portStr;
+		ss << str;
 		ss >> port;
-		dispatchSocket->close();
-		std::cout << "client close" << std::endl;
-
-		std::thread([&callback, addr, port]() -> void {
-			boost::asio::io_service io_service;
-			std::shared_ptr<boost::asio::ip::tcp::socket> socket(new boost::asio::ip::tcp::socket(io_service));
+		if (!(ss >> features))
+			features = 0;
+	}
+	inline void clientSession(std::shared_ptr<SocketType> socket, uint32 serverFeatures, uint32 wantedFeatures, std::function<void(std::shared_ptr<Connection>)>& callback) {
+		std::shared_ptr<Connection> conn(new Connection(socket));
+		if (serverFeatures & wantedFeatures) {
+			auto features = Client<AW::uint32, AW::uint32>(conn, HELLO_FUNC_NAME)(serverFeatures & wantedFeatures);
+#ifdef __AW_SHM__
+			if (features & FeatureSharedMemory)
+				conn->setSocket(ShmSocket::connect(socket));
+#endif
+			conn->setFeatures(features);
+			if (features & FeatureMethodIds)
+				conn->setMethodIds(Client<std::vector<AW::string>, AW::uint32>(conn, METHODS_FUNC_NAME)(0));
+		}
+		callback(conn);
+	}
 
-			try {
-				socket->connect(tcp::endpoint(boost::asio::ip::address::from_string(addr), port));
-				callback(socket);
-			}
-			catch (std::exception& e) {
-				std::cout << e.what() << std::endl;
+	// Port 0 in the handshake keeps the session on the first socket, servers
+	// with a port per session get a second connection
+	inline void clientStart(std::string addr, std::function<void(std::shared_ptr<Connection>)> callback, uint32 wantedFeatures = SUPPORTED_FEATURES) {
+		std::shared_ptr<boost::asio::io_service> io_service(new boost::asio::io_service);
+		std::shared_ptr<TcpSocket> socket(new TcpSocket(io_service));
+		socket->get().connect(tcp::endpoint(boost::asio::ip::address::from_string(addr), DEFAULT_PORT));
+		uint32 port, serverFeatures;
+		parseHandshake(AwSocket::receiveString(socket), port, serverFeatures);
+
+		try {
+			if (port != 0) {
+				socket->close();
+				socket.reset(new TcpSocket(io_service));
+				socket->get().connect(tcp::endpoint(boost::asio::ip::address::from_string(addr), port));
 			}
-		}).join();
+			clientSession(socket, serverFeatures, wantedFeatures, callback);
+		}
+		catch (std::exception& e) {
+			std::cout << e.what() << std::endl;
+		}
+	}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	// a literal address is TCP, a local endpoint converts from strings too
+	inline void clientStart(const char* addr, std::function<void(std::shared_ptr<Connection>)> callback, uint32 wantedFeatures = SUPPORTED_FEATURES) {
+		clientStart(std::string(addr), callback, wantedFeatures);
+	}
+	// The session stays on the socket the handshake came in on
+	inline void clientStart(const boost::asio::local::stream_protocol::endpoint& endpoint, std::function<void(std::shared_ptr<Connection>)> callback, uint32 wantedFeatures = LOCAL_FEATURES) {
+		std::shared_ptr<boost::asio::io_service> io_service(new boost::asio::io_service);
+		std::shared_ptr<LocalSocket> socket(new LocalSocket(io_service));
+
+		try {
+			socket->get().connect(endpoint);
+			uint32 port, serverFeatures;
+			parseHandshake(AwSocket::receiveString(socket), port, serverFeatures);
+			clientSession(socket, serverFeatures, wantedFeatures, callback);
+		}
+		catch (std::exception& e) {
+			std::cout << e.what() << std::endl;
+		}
 	}
+#endif
 
 }
 
@@ -0,0 +1,204 @@
+#ifndef __AW_SHM_SOCKET_H__
+#define __AW_SHM_SOCKET_H__
+
+#include "ArchDeps.h"
+#include "AwSocket.h"
+
+#ifdef __AW_SHM__
+#include <atomic>
+#include <memory>
+#include <new>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Shared memory transport
+	// A local session can move onto a pair of single producer, single consumer
+	// byte rings in one shared memory segment, one ring per direction. Bytes
+	// are copied straight between the rings and the connection's buffers, and
+	// the futex calls are only made when the other side is asleep.
+	// The local socket the session started on stays open; it is watched to
+	// notice a peer that went away without closing.
+	//////////////////////////////////////////////////////////////////////////
+	static_assert(ATOMIC_INT_LOCK_FREE == 2, "the rings need lock free atomics");
+
+	struct ShmRing {
+		std::atomic<uint32> head;			// bytes written so far, wraps
+		std::atomic<uint32> readerWaiting;
+		byte pad1[56];
+		std::atomic<uint32> tail;			// bytes read so far, wraps
+		std::atomic<uint32> writerWaiting;
+		byte pad2[56];
+		byte data[SHM_RING_LENGTH];
+	};
+	struct ShmSegment {
+		uint32 magic;
+		std::atomic<uint32> closed;
+		byte pad[56];
+		ShmRing rings[2];	// client to server, server to client
+	};
+	constexpr uint32 SHM_MAGIC = 0x4d485341;	// "ASHM"
+
+	class ShmSocket :public SocketType {
+	public:
+		// client side: creates the segment and tells the server its name
+		static std::shared_ptr<ShmSocket> connect(std::shared_ptr<SocketType> control) {
+			static std::atomic<uint32> counter(0);
+			std::string name = "/awrpc-" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+			int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+			if (fd < 0)
+				throw std::runtime_error("shm_open");
+			if (ftruncate(fd, sizeof(ShmSegment)) != 0) {
+				::close(fd);
+				shm_unlink(name.c_str());
+				throw std::runtime_error("ftruncate");
+			}
+			std::shared_ptr<ShmSocket> ret(new ShmSocket(control, fd, 0));
+			new (ret->segment) ShmSegment();
+			ret->segment->magic = SHM_MAGIC;
+
+			try {
+				AwSocket::sendString(control, StdStringToAwString(name));
+				AwSocket::receiveString(control);
+			}
+			catch (...) {
+				shm_unlink(name.c_str());
+				throw;
+			}
+			// both sides have it mapped, the name is not needed any more
+			shm_unlink(name.c_str());
+			return ret;
+		}
+		// server side: maps the segment the client named
+		static std::shared_ptr<ShmSocket> accept(std::shared_ptr<SocketType> control) {
+			std::string name = AwStringToStdString(AwSocket::receiveString(control));
+			int fd = shm_open(name.c_str(), O_RDWR, 0600);
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st) != 0 || st.st_size != static_cast<off_t>(sizeof(ShmSegment))) {
+				if (fd >= 0)
+					::close(fd);
+				throw std::runtime_error("wrong format");
+			}
+			std::shared_ptr<ShmSocket> ret(new ShmSocket(control, fd, 1));
+			assert_format(ret->segment->magic == SHM_MAGIC);
+			AwSocket::sendString(control, t("ok"));
+			return ret;
+		}
+		~ShmSocket() {
+			close();
+			munmap(segment, sizeof(ShmSegment));
+		}
+
+		virtual uint32 readSome(byte* data, uint32 length) override {
+			uint32 tail = in->tail.load(std::memory_order_relaxed);
+			uint32 available = waitFor(in->head, in->readerWaiting, [tail](uint32 head) { return head - tail; });
+			uint32 n = std::min(available, length);
+			copyOut(data, tail, n);
+			// sequentially consistent, so that either wake sees waiting set or the waiter sees the new value
+			in->tail.store(tail + n);
+			wake(in->tail, in->writerWaiting);
+			return n;
+		}
+		virtual void write(const byte* header, uint32 headerLength, const byte* data, uint32 length) override {
+			writeAll(header, headerLength);
+			writeAll(data, length);
+		}
+		virtual void close() override {
+			if (segment->closed.exchange(1) == 0) {
+				for (auto& r : segment->rings) {
+					wake(r.head, r.readerWaiting);
+					wake(r.tail, r.writerWaiting);
+				}
+			}
+			control->close();
+		}
+	private:
+		ShmSocket(std::shared_ptr<SocketType> control, int fd, uint32 side) :control(control) {
+			void* p = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (p == MAP_FAILED)
+				throw std::runtime_error("mmap");
+			segment = static_cast<ShmSegment*>(p);
+			out = &segment->rings[side];
+			in = &segment->rings[1 - side];
+			auto local = std::dynamic_pointer_cast<LocalSocket>(control);
+			if (local == nullptr) {
+				munmap(p, sizeof(ShmSegment));
+				throw std::runtime_error("shared memory needs a local socket");
+			}
+			controlFd = local->get().native_handle();
+		}
+
+		void writeAll(const byte* data, uint32 length) {
+			while (length > 0) {
+				uint32 head = out->head.load(std::memory_order_relaxed);
+				uint32 space = waitFor(out->tail, out->writerWaiting, [head](uint32 tail) { return SHM_RING_LENGTH - (head - tail); });
+				uint32 n = std::min(space, length);
+				copyIn(head, data, n);
+				out->head.store(head + n);
+				wake(out->head, out->readerWaiting);
+				data += n;
+				length -= n;
+			}
+		}
+		void copyIn(uint32 position, const byte* data, uint32 n) {
+			uint32 at = position % SHM_RING_LENGTH, first = std::min(n, SHM_RING_LENGTH - at);
+			memcpy(out->data + at, data, first);
+			memcpy(out->data, data + first, n - first);
+		}
+		void copyOut(byte* data, uint32 position, uint32 n) {
+			uint32 at = position % SHM_RING_LENGTH, first = std::min(n, SHM_RING_LENGTH - at);
+			memcpy(data, in->data + at, first);
+			memcpy(data + first, in->data, n - first);
+		}
+
+		// Waits until amount(word) is not 0 and returns it. Spins a little first,
+		// then sleeps on the futex with waiting set, so the other side knows to wake it.
+		template<typename AmountT>
+		uint32 waitFor(std::atomic<uint32>& word, std::atomic<uint32>& waiting, AmountT amount) {
+			for (uint32 spin = 0;; ++spin) {
+				uint32 value = word.load(std::memory_order_acquire);
+				if (amount(value) != 0)
+					return amount(value);
+				if (segment->closed.load(std::memory_order_relaxed) != 0)
+					throw std::runtime_error("disconnect");
+				if (spin < SHM_SPIN_COUNT)
+					continue;
+				waiting.store(1);
+				if (word.load() == value) {
+					// wakes up now and then to notice a peer that died
+					timespec timeout = { 0, 100 * 1000 * 1000 };
+					syscall(SYS_futex, reinterpret_cast<uint32*>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+					if (peerGone())
+						throw std::runtime_error("disconnect");
+				}
+				waiting.store(0);
+			}
+		}
+		void wake(std::atomic<uint32>& word, std::atomic<uint32>& waiting) {
+			if (waiting.load() != 0)
+				syscall(SYS_futex, reinterpret_cast<uint32*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+		}
+		bool peerGone() const {
+			pollfd p = { controlFd, POLLRDHUP, 0 };
+			return poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+		}
+
+		std::shared_ptr<SocketType> control;
+		int controlFd;
+		ShmSegment* segment;
+		ShmRing* out;
+		ShmRing* in;
+	};
+}
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __AW_SINGLE_FLIGHT_H__
+#define __AW_SINGLE_FLIGHT_H__
+
+#include "ArchDeps.h"
+#include "Elements.h"
+#include "AwSocket.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Single flight
+	// The calls of one method that are running, keyed like the reply cache.
+	// A call with the key of a running one does not run itself but gets the
+	// reply of the running call: it attaches to the call and is sent the
+	// reply when it is done, or waits for it where it cannot be sent later.
+	//////////////////////////////////////////////////////////////////////////
+	class SingleFlight {
+	public:
+		class Flight {
+		public:
+			Flight() :done(false) { }
+
+			// the reply when the call is done already; nullptr when the caller
+			// was attached instead: it is sent the reply, then sent is called
+			std::shared_ptr<const ByteBuffer> join(std::shared_ptr<Connection> conn, uint32 requestId, const std::function<void()>& sent) {
+				std::lock_guard<std::mutex> lock(mu);
+				if (done)
+					return reply;
+				attached.push_back(Waiter{ conn, requestId, sent });
+				return nullptr;
+			}
+			std::shared_ptr<const ByteBuffer> wait() {
+				std::unique_lock<std::mutex> lock(mu);
+				finished.wait(lock, [this]() { return done; });
+				return reply;
+			}
+		private:
+			friend class SingleFlight;
+			struct Waiter {
+				std::shared_ptr<Connection> conn;
+				uint32 requestId;
+				std::function<void()> sent;
+			};
+
+			std::mutex mu;
+			std::condition_variable finished;
+			bool done;
+			std::shared_ptr<const ByteBuffer> reply;
+			std::vector<Waiter> attached;
+		};
+
+		SingleFlight() :coalesced(0) { }
+
+		// the flight running key, or a new one when leader comes back true:
+		// then the caller runs the call and ends the flight with finish
+		std::shared_ptr<Flight> begin(const std::string& key, bool& leader) {
+			std::lock_guard<std::mutex> lock(mu);
+			auto& flight = running[key];
+			leader = flight == nullptr;
+			if (leader)
+				flight.reset(new Flight);
+			else
+				coalesced++;
+			return flight;
+		}
+		// hands reply, packed for the key's connections (AwSocket::packMessage),
+		// to the callers that waited and sends it to those that attached
+		void finish(const std::string& key, std::shared_ptr<Flight> flight, std::shared_ptr<const ByteBuffer> reply) {
+			{
+				// calls from now on run again
+				std::lock_guard<std::mutex> lock(mu);
+				running.erase(key);
+			}
+			std::vector<Flight::Waiter> attached;
+			{
+				std::lock_guard<std::mutex> lock(flight->mu);
+				flight->reply = reply;
+				flight->done = true;
+				attached.swap(flight->attached);
+			}
+			flight->finished.notify_all();
+			for (auto& w : attached) {
+				try {
+					AwSocket::sendPacked(w.conn, reply->data(), reply->size(), w.requestId);
+				}
+				catch (std::exception&) { }
+				if (w.sent != nullptr)
+					w.sent();
+			}
+		}
+
+		// calls that got the reply of another instead of running
+		uint64 getCoalesced() const { return coalesced; }
+	private:
+		std::mutex mu;
+		std::unordered_map<std::string, std::shared_ptr<Flight>> running;
+		std::atomic<uint64> coalesced;
+	};
+}
+
+#endif
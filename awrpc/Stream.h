@@ -0,0 +1,114 @@
+#ifndef __AW_STREAM_H__
+#define __AW_STREAM_H__
+
+#include "ArchDeps.h"
+#include "Elements.h"
+#include "AwSocket.h"
+#include "Codec.h"
+#include "Client.h"
+#include <vector>
+#include <memory>
+#include <functional>
+#include <exception>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// Streamed replies
+	// A stream handler writes its elements one at a time instead of returning
+	// a vector. They go out in chunks of about STREAM_CHUNK_LENGTH bytes, each
+	// a tuple of a "more" flag and a vector of elements, the last one with
+	// more 0. The reader acknowledges every chunk before it with a __CREDIT
+	// call, and the writer stays at most STREAM_WINDOW chunks ahead, so
+	// neither side holds more than a window however long the stream is.
+	// An error reply may end a stream at any chunk. Chunks carry the request
+	// ID of their call, so streams and calls may share a connection.
+	//////////////////////////////////////////////////////////////////////////
+	template<typename ElementT>
+	class StreamWriter {
+	public:
+		StreamWriter(std::shared_ptr<Connection> conn, AW::uint32 requestId) :conn(conn), requestId(requestId), size(0) { }
+
+		void write(const ElementT& e) {
+			batch.push_back(e);
+			// only to know when the chunk is full, flush sizes the batch for encoding
+			sizes.clear();
+			size += Codec<ElementT>::size(conn->getFormat(), e, sizes);
+			if (size >= STREAM_CHUNK_LENGTH)
+				flush(true);
+		}
+		// sends the last chunk, once the handler is done
+		void finish() {
+			flush(false);
+		}
+	private:
+		void flush(bool more) {
+			if (more)
+				conn->takeCredit();
+			auto format = conn->getFormat();
+			AW::uint32 flag = more ? 1 : 0;
+			{
+				std::lock_guard<std::mutex> lock(conn->getWriteLock());
+				auto& out = conn->getWriteBuffer();
+				sizes.clear();
+				out.resize(tupleSize(format, sizes, flag, batch));
+				AW::byte* p = out.data();
+				encodeTuple(format, p, sizes, flag, batch);
+				AwSocket::sendMessage(conn, out.data(), out.size(), requestId);
+			}
+			// keeps its capacity for the next chunk
+			batch.clear();
+			size = 0;
+		}
+
+		std::shared_ptr<Connection> conn;
+		AW::uint32 requestId;
+		std::vector<ElementT> batch;
+		AW::uint32 size;	// encoded bytes of batch
+		CodecSizes sizes;
+	};
+
+	// Calls a stream handler, consumer gets the elements chunk by chunk
+	template<typename ElementT, typename...ArgsT>
+	class StreamClient {
+	public:
+		StreamClient(std::shared_ptr<Connection> conn, const AW::string& name) :conn(conn), name(name) { }
+
+		void operator()(const ArgsT&... args, const std::function<void(std::vector<ElementT>&)>& consumer) {
+			AW::uint32 requestId = sendCall(conn, name, args...);
+			// chunks that come after a chunk failed to decode are dropped
+			ReplyWait wait(conn, requestId);
+
+			// a consumer that throws still reads the stream to its end, the
+			// connection would be out of step otherwise
+			std::exception_ptr failure;
+			for (bool more = true; more;) {
+				AW::uint32 length = 0;
+				auto chunk = AwSocket::receiveReply(conn, length, requestId);
+				auto format = detectFormat(chunk.get());
+				AW::uint32 offset = messageBodyOffset(format, chunk.get(), length);
+				auto decoded = Codec<std::tuple<AW::uint32, std::vector<ElementT>>>::decode(format, chunk.get(), length, offset);
+				assert_format(offset == length);
+				chunk = nullptr;
+
+				more = std::get<0>(decoded) != 0;
+				if (more)
+					sendNotice(conn, CREDIT_FUNC_NAME, AW::uint32(1));
+				if (failure == nullptr) {
+					try {
+						consumer(std::get<1>(decoded));
+					}
+					catch (...) {
+						failure = std::current_exception();
+					}
+				}
+			}
+			if (failure != nullptr)
+				std::rethrow_exception(failure);
+		}
+	private:
+		std::shared_ptr<Connection> conn;
+		AW::string name;
+	};
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef __AW_STRING_TABLE_H__
+#define __AW_STRING_TABLE_H__
+
+#include "ArchDeps.h"
+#include "Elements.h"
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+
+namespace AW {
+	//////////////////////////////////////////////////////////////////////////
+	// String interning
+	// Rewrites an encoded binary message so that strings it repeats are stored
+	// once in a table in front of the root element (layout in Elements.h).
+	// It works on the encoded bytes, so every encoder gets it for free.
+	//////////////////////////////////////////////////////////////////////////
+	class StringInterner {
+	public:
+		StringInterner(const AW::byte* data, AW::uint32 length) :data(data), length(length) { }
+
+		// false when nothing repeats enough to pay for the table
+		bool intern(ByteBuffer& out) {
+			if (detectFormat(data) != WireFormat::Binary || messageBodyOffset(WireFormat::Binary, data, length) != 0)
+				return false;
+			AW::uint32 offset = 0;
+			count(offset, length);
+			if (offset != length)
+				return false;
+
+			offset = 0;
+			AW::uint32 bodySize = measure(offset, length);
+			if (order.empty())
+				return false;
+
+			// fixed32 count, fixed32 offsets, entries
+			AW::uint32 entriesSize = 0;
+			for (auto e : order)
+				entriesSize += 1 + varintSize(e->size) + e->size;
+			AW::uint32 tableSize = 4 + 4 * order.size() + entriesSize;
+			AW::uint32 tableHeader = 1 + varintSize(tableSize);
+			if (tableHeader + tableSize + bodySize >= length)
+				return false;
+
+			out.resize(tableHeader + tableSize + bodySize);
+			AW::byte* p = out.data();
+			*p++ = static_cast<AW::byte>(BinaryTag::StringTable);
+			writeVarint(p, tableSize);
+			writeFixed32(p, order.size());
+			AW::uint32 entry = tableHeader + 4 + 4 * order.size();
+			for (auto e : order) {
+				writeFixed32(p, entry);
+				entry += 1 + varintSize(e->size) + e->size;
+			}
+			for (auto e : order) {
+				*p++ = static_cast<AW::byte>(BinaryTag::String);
+				writeVarint(p, e->size);
+				memcpy(p, e->data, e->size);
+				p += e->size;
+			}
+
+			offset = 0;
+			AW::uint32 container = 0;
+			write(offset, length, p, container);
+			return true;
+		}
+
+	private:
+		struct Entry {
+			const AW::byte* data;
+			AW::uint32 size;
+			AW::uint32 uses;
+			AW::int32 index;	// -1 while not in the table
+		};
+		struct Key {
+			const AW::byte* data;
+			AW::uint32 size;
+			bool operator==(const Key& r) const { return size == r.size && memcmp(data, r.data, size) == 0; }
+		};
+		// FNV-1a
+		struct KeyHash {
+			size_t operator()(const Key& k) const {
+				AW::uint32 h = 2166136261u;
+				for (AW::uint32 i = 0; i < k.size; ++i)
+					h = (h ^ k.data[i]) * 16777619u;
+				return h;
+			}
+		};
+
+		void count(AW::uint32& offset, AW::uint32 end) {
+			auto h = readElementHeader(WireFormat::Binary, data, end, offset);
+			if (h.tag == BinaryTag::String) {
+				Key k = { data + h.offset, h.size };
+				auto it = strings.find(k);
+				if (it == strings.end()) {
+					Entry e = { k.data, k.size, 1, -1 };
+					strings.insert(std::make_pair(k, e));
+				}
+				else
+					it->second.uses++;
+			}
+			else if (h.tag == BinaryTag::Tuple || h.tag == BinaryTag::Map) {
+				for (AW::uint32 pos = h.offset; pos < offset;)
+					count(pos, offset);
+			}
+		}
+
+		// encoded size after interning; strings join the table in order of first use
+		AW::uint32 measure(AW::uint32& offset, AW::uint32 end) {
+			AW::uint32 start = offset;
+			auto h = readElementHeader(WireFormat::Binary, data, end, offset);
+			if (h.tag == BinaryTag::String) {
+				Entry& e = strings.find(Key{ data + h.offset, h.size })->second;
+				if (e.index < 0) {
+					// a table entry costs its offset, every use its reference
+					AW::uint32 plain = 1 + varintSize(e.size) + e.size;
+					if ((e.uses - 1) * plain <= 4 + e.uses * varintSize(order.size()))
+						return offset - start;
+					e.index = order.size();
+					order.push_back(&e);
+				}
+				return 1 + varintSize(e.index);
+			}
+			if (h.tag == BinaryTag::Tuple || h.tag == BinaryTag::Map) {
+				AW::uint32 slot = payloads.size();
+				payloads.push_back(0);
+				AW::uint32 payload = 0;
+				for (AW::uint32 pos = h.offset; pos < offset;)
+					payload += measure(pos, offset);
+				payloads[slot] = payload;
+				return 1 + varintSize(payload) + payload;
+			}
+			return offset - start;
+		}
+
+		void write(AW::uint32& offset, AW::uint32 end, AW::byte*& out, AW::uint32& container) {
+			AW::uint32 start = offset;
+			auto h = readElementHeader(WireFormat::Binary, data, end, offset);
+			if (h.tag == BinaryTag::String) {
+				const Entry& e = strings.find(Key{ data + h.offset, h.size })->second;
+				if (e.index >= 0) {
+					*out++ = static_cast<AW::byte>(BinaryTag::Interned);
+					writeVarint(out, e.index);
+					return;
+				}
+			}
+			else if (h.tag == BinaryTag::Tuple || h.tag == BinaryTag::Map) {
+				*out++ = static_cast<AW::byte>(h.tag);
+				writeVarint(out, payloads[container++]);
+				for (AW::uint32 pos = h.offset; pos < offset;)
+					write(pos, offset, out, container);
+				return;
+			}
+			memcpy(out, data + start, offset - start);
+			out += offset - start;
+		}
+
+		const AW::byte* data;
+		AW::uint32 length;
+		std::unordered_map<Key, Entry, KeyHash> strings;
+		std::vector<Entry*> order;
+		std::vector<AW::uint32> payloads;	// new container sizes, in preorder
+	};
+}
+
+#endif
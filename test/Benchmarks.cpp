@@ -0,0 +1,93 @@
+#include "Tests.h"
+#include "TestServer.h"
+#include <Elements.h>
+#include <FlatElements.h>
+#include <chrono>
+#include <sstream>
+
+namespace AW {
+	namespace Tests {
+		namespace {
+			template<typename FuncT>
+			double millis(FuncT body) {
+				auto start = std::chrono::steady_clock::now();
+				body();
+				return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			}
+
+			// a text message of rows like a search result's, about 1.4 MB for 20000
+			void textDecoding(AW::uint32 rows) {
+				std::shared_ptr<TupleType> root(new TupleType);
+				for (AW::uint32 i = 0; i < rows; ++i) {
+					std::shared_ptr<TupleType> row(new TupleType);
+					row->add(std::shared_ptr<ElementBase>(new Element<AW::string>(t("name") + StdStringToAwString(std::to_string(i)))));
+					row->add(std::shared_ptr<ElementBase>(new Element<AW::uint32>(i * 2654435761u)));
+					row->add(std::shared_ptr<ElementBase>(new Element<AW::int32>(-static_cast<AW::int32>(i))));
+					row->add(std::shared_ptr<ElementBase>(new Element<AW::real64>(i * 0.5)));
+					root->add(row);
+				}
+				AW::uint32 length = root->encodedSize(WireFormat::Text);
+				std::shared_ptr<AW::byte> buffer(new AW::byte[length], std::default_delete<AW::byte[]>());
+				AW::byte* out = buffer.get();
+				root->encodeTo(WireFormat::Text, out);
+				AW::string text(reinterpret_cast<const AW::character*>(buffer.get()), length / sizeof(AW::character));
+
+				std::shared_ptr<ElementBase> legacy, decoded;
+				double legacyTime = millis([&]() {
+					std::basic_stringstream<AW::character> ss(text);
+					legacy = fromString(ss);
+				});
+				double decoderTime = millis([&]() { decoded = Decoder(buffer, length).decode(); });
+				FlatDocument doc;
+				double flatTime = millis([&]() { doc.parse(buffer, length); });
+				// every header of the message, the part parseHex does
+				AW::uint32 headers = 0;
+				double headerTime = millis([&]() {
+					for (AW::uint32 offset = 0; offset < length; ++headers) {
+						auto header = readElementHeader(WireFormat::Text, buffer.get(), length, offset);
+						if (header.tag == BinaryTag::Tuple)
+							offset = header.offset;
+					}
+				});
+				CHECK(legacy->toString() == text && decoded->toString() == text && doc.root().size() == rows);
+
+				std::cout << "text message of " << rows << " rows, " << length << " bytes:" << std::endl
+					<< "  fromString " << legacyTime << " ms" << std::endl
+					<< "  Decoder " << decoderTime << " ms" << std::endl
+					<< "  FlatDocument " << flatTime << " ms" << std::endl
+					<< "  " << headers << " headers " << headerTime << " ms" << std::endl;
+			}
+
+			// sessions that connect, make one call and close, on the session's
+			// first socket and then with a port per session
+			void sessionChurn(AW::uint32 cycles) {
+				AwRpc& rpc = testServer();
+				for (bool portPerSession : { false, true }) {
+					rpc.setPortPerSession(portPerSession);
+					AW::uint32 answered = 0;
+					// the server tells of every session
+					std::cout.setstate(std::ios::failbit);
+					double time = millis([&]() {
+						for (AW::uint32 i = 0; i < cycles; ++i) {
+							clientStart("127.0.0.1", [&](std::shared_ptr<Connection> conn) {
+								Client<AW::string, AW::string> echo(conn, t("echo"));
+								if (echo(t("x")) == t("x"))
+									answered++;
+							});
+						}
+					});
+					std::cout.clear();
+					CHECK(answered == cycles);
+					std::cout << cycles << " sessions " << (portPerSession ? "with a port each" : "on the first socket") << ": "
+						<< time * 1000 / cycles << " us each" << std::endl;
+				}
+				rpc.setPortPerSession(false);
+			}
+		}
+
+		void benchmarks() {
+			textDecoding(20000);
+			sessionChurn(2000);
+		}
+	}
+}
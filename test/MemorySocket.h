@@ -0,0 +1,74 @@
+#ifndef __AW_MEMORY_SOCKET_H__
+#define __AW_MEMORY_SOCKET_H__
+
+#include <AwSocket.h>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <utility>
+
+namespace AW {
+	namespace Tests {
+		//////////////////////////////////////////////////////////////////////////
+		// In-memory stream transport
+		// Two connected ends, what one writes the other reads. A read returns
+		// at most readLimit bytes, so messages can be made to arrive in pieces.
+		//////////////////////////////////////////////////////////////////////////
+		class MemorySocket :public SocketType {
+		public:
+			static std::pair<std::shared_ptr<MemorySocket>, std::shared_ptr<MemorySocket>> pair(uint32 readLimit = 0xffffffffu) {
+				std::shared_ptr<Pipe> ab(new Pipe), ba(new Pipe);
+				return std::make_pair(std::shared_ptr<MemorySocket>(new MemorySocket(ba, ab, readLimit)), std::shared_ptr<MemorySocket>(new MemorySocket(ab, ba, readLimit)));
+			}
+
+			virtual uint32 readSome(byte* data, uint32 length) override {
+				std::unique_lock<std::mutex> lock(in->mu);
+				in->arrived.wait(lock, [this]() { return !in->bytes.empty() || in->closed; });
+				if (in->bytes.empty())
+					throw std::runtime_error("disconnect");
+				uint32 n = std::min<size_t>(std::min(length, readLimit), in->bytes.size());
+				std::copy(in->bytes.begin(), in->bytes.begin() + n, data);
+				in->bytes.erase(in->bytes.begin(), in->bytes.begin() + n);
+				return n;
+			}
+			virtual void write(const byte* header, uint32 headerLength, const byte* data, uint32 length) override {
+				std::lock_guard<std::mutex> lock(out->mu);
+				if (out->closed)
+					throw std::runtime_error("disconnect");
+				out->bytes.insert(out->bytes.end(), header, header + headerLength);
+				out->bytes.insert(out->bytes.end(), data, data + length);
+				out->written += headerLength + length;
+				out->arrived.notify_all();
+			}
+			virtual void close() override {
+				for (auto& p : { in, out }) {
+					std::lock_guard<std::mutex> lock(p->mu);
+					p->closed = true;
+					p->arrived.notify_all();
+				}
+			}
+			// bytes this end has written so far
+			uint64 getWritten() {
+				std::lock_guard<std::mutex> lock(out->mu);
+				return out->written;
+			}
+		private:
+			struct Pipe {
+				std::mutex mu;
+				std::condition_variable arrived;
+				std::deque<byte> bytes;
+				uint64 written = 0;
+				bool closed = false;
+			};
+
+			MemorySocket(std::shared_ptr<Pipe> in, std::shared_ptr<Pipe> out, uint32 readLimit) :in(in), out(out), readLimit(readLimit) { }
+
+			std::shared_ptr<Pipe> in;
+			std::shared_ptr<Pipe> out;
+			uint32 readLimit;
+		};
+	}
+}
+
+#endif
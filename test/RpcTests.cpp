@@ -0,0 +1,87 @@
+#include "Tests.h"
+#include "TestServer.h"
+#include <memory>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+namespace AW {
+	namespace Tests {
+		namespace {
+			// a repeated call is answered from the cache, its handler does not run
+			void cachedReplies() {
+				auto cache = testServer().getReplyCache(t("square"));
+				CHECK(cache != nullptr && testServer().getReplyCache(t("echo")) == nullptr);
+				uint64 hits = cache->getHits(), misses = cache->getMisses();
+				uint32 runs = testServerRuns().square;
+
+				clientStart("127.0.0.1", [](std::shared_ptr<Connection> conn) {
+					Client<AW::uint32, AW::uint32> square(conn, t("square"));
+					CHECK(square(3) == 9 && square(3) == 9 && square(3) == 9);
+					CHECK(square(4) == 16);
+				});
+				CHECK(cache->getHits() - hits == 2 && cache->getMisses() - misses == 2);
+				CHECK(testServerRuns().square - runs == 2);
+
+				// the stored reply is in the other connection's format
+				clientStart("127.0.0.1", [](std::shared_ptr<Connection> conn) {
+					Client<AW::uint32, AW::uint32> square(conn, t("square"));
+					CHECK(square(3) == 9 && square(3) == 9);
+				}, 0);
+				CHECK(cache->getHits() - hits == 3 && cache->getMisses() - misses == 3);
+				CHECK(testServerRuns().square - runs == 3);
+
+				// replies are kept interned and compressed, for connections that
+				// take them that way only
+				auto linkCache = testServer().getReplyCache(t("links"));
+				hits = linkCache->getHits();
+				misses = linkCache->getMisses();
+				for (uint32 features : { SUPPORTED_FEATURES, FeatureBinary | FeatureFraming }) {
+					clientStart("127.0.0.1", [](std::shared_ptr<Connection> conn) {
+						Client<std::vector<AW::string>, AW::uint32> get(conn, t("links"));
+						CHECK(get(2000) == links(2000, 10) && get(2000) == links(2000, 10));
+					}, features);
+				}
+				CHECK(linkCache->getHits() - hits == 2 && linkCache->getMisses() - misses == 2);
+			}
+
+			// calls from several connections with the arguments of a running
+			// call get its reply, over ordered and request ID connections alike
+			void coalescedCalls() {
+				const uint32 callers = 6;
+				auto flights = testServer().getSingleFlight(t("held"));
+				CHECK(flights != nullptr);
+				uint64 coalesced = flights->getCoalesced();
+				uint32 runs = testServerRuns().held;
+				testServerRuns().release = false;
+
+				std::vector<uint32> answers(callers);
+				std::vector<std::thread> threads;
+				for (uint32 i = 0; i < callers; ++i) {
+					uint32 features = i % 2 == 0 ? SUPPORTED_FEATURES : SUPPORTED_FEATURES & ~FeatureRequestIds;
+					threads.push_back(std::thread([&answers, i, features]() {
+						clientStart("127.0.0.1", [&answers, i](std::shared_ptr<Connection> conn) {
+							answers[i] = Client<AW::uint32, AW::uint32>(conn, t("held"))(7);
+						}, features);
+					}));
+				}
+				// the first call is held until every other one joined it
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+				while (flights->getCoalesced() - coalesced < callers - 1 && std::chrono::steady_clock::now() < deadline)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				testServerRuns().release = true;
+				for (auto& thread : threads)
+					thread.join();
+
+				CHECK(flights->getCoalesced() - coalesced == callers - 1);
+				CHECK(testServerRuns().held - runs == 1);
+				CHECK(answers == std::vector<uint32>(callers, 7));
+			}
+		}
+
+		void rpcTests() {
+			cachedReplies();
+			coalescedCalls();
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef __AW_TEST_SERVER_H__
+#define __AW_TEST_SERVER_H__
+
+#include "Tests.h"
+#include <Server.h>
+#include <Client.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace AW {
+	namespace Tests {
+		// how often the test server's handlers ran
+		struct TestServerRuns {
+			std::atomic<uint32> square{ 0 };
+			std::atomic<uint32> held{ 0 };
+			// held calls return once this is set
+			std::atomic<bool> release{ false };
+		};
+		inline TestServerRuns& testServerRuns() {
+			static TestServerRuns runs;
+			return runs;
+		}
+
+		//////////////////////////////////////////////////////////////////////////
+		// The server of the tests that need the network, on DEFAULT_PORT. It is
+		// started on first use and serves until the program ends:
+		//   echo(string) returns its argument
+		//   square(uint32) returns its argument squared, replies are cached
+		//   links(uint32) returns that many links, replies are cached
+		//   held(uint32) returns its argument once released, calls are coalesced
+		// Calls run on several handler threads.
+		//////////////////////////////////////////////////////////////////////////
+		inline AwRpc& testServer() {
+			static AwRpc* rpc = []() {
+				AwRpc* ret = new AwRpc(std::vector<std::shared_ptr<AbstractServerBase>>{
+					std::shared_ptr<AbstractServerBase>(new Server<AW::string, AW::string>([](AW::string v) { return v; }, t("echo"))),
+					std::shared_ptr<AbstractServerBase>(new Server<AW::uint32, AW::uint32>([](AW::uint32 v) {
+						testServerRuns().square++;
+						return v * v;
+					}, t("square"))),
+					std::shared_ptr<AbstractServerBase>(new Server<std::vector<AW::string>, AW::uint32>([](AW::uint32 count) {
+						return links(count, 10);
+					}, t("links"))),
+					std::shared_ptr<AbstractServerBase>(new Server<AW::uint32, AW::uint32>([](AW::uint32 v) {
+						testServerRuns().held++;
+						while (!testServerRuns().release)
+							std::this_thread::sleep_for(std::chrono::milliseconds(1));
+						return v;
+					}, t("held")))
+				});
+				ret->setHandlerThreadCount(4);
+				ret->cacheReplies(t("square"), std::chrono::minutes(1), 100);
+				ret->cacheReplies(t("links"), std::chrono::minutes(1), 100);
+				ret->coalesceCalls(t("held"));
+				ret->startServiceAsync();
+				// listening once a connect goes through
+				boost::asio::io_service service;
+				for (;;) {
+					tcp::socket probe(service);
+					boost::system::error_code ec;
+					probe.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), DEFAULT_PORT), ec);
+					if (!ec)
+						break;
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+				return ret;
+			}();
+			return *rpc;
+		}
+	}
+}
+
+#endif
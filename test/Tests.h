@@ -0,0 +1,57 @@
+#ifndef __AW_TESTS_H__
+#define __AW_TESTS_H__
+
+#include <ArchDeps.h>
+#include <iostream>
+#include <vector>
+#include <string>
+
+namespace AW {
+	namespace Tests {
+		//////////////////////////////////////////////////////////////////////////
+		// Checks of the test program
+		// A failed check is reported and counted, the test goes on; main
+		// returns non-zero when any failed.
+		//////////////////////////////////////////////////////////////////////////
+		inline int& failures() {
+			static int count = 0;
+			return count;
+		}
+		inline void check(bool ok, const char* what, const char* file, int line) {
+			if (ok)
+				return;
+			std::cout << file << ":" << line << ": check failed: " << what << std::endl;
+			failures()++;
+		}
+		// true when body throws
+		template<typename FuncT>
+		bool throws(FuncT body) {
+			try {
+				body();
+			}
+			catch (std::exception&) {
+				return true;
+			}
+			return false;
+		}
+
+		// ed2k links like the ones searches return, distinct of them different
+		inline std::vector<AW::string> links(AW::uint32 count, AW::uint32 distinct) {
+			std::vector<AW::string> ret;
+			for (AW::uint32 i = 0; i < count; ++i)
+				ret.push_back(t("ed2k://|file|") + StdStringToAwString(std::to_string(i % distinct)) + t("|4096|"));
+			return ret;
+		}
+
+		void wireTests();
+		void transportTests();
+		// against a server on DEFAULT_PORT, see TestServer.h
+		void rpcTests();
+		// timings, run with the argument bench
+		void benchmarks();
+	}
+}
+
+#define CHECK(x) AW::Tests::check((x), #x, __FILE__, __LINE__)
+
+#endif
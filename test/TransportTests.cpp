@@ -0,0 +1,147 @@
+#include "Tests.h"
+#include "MemorySocket.h"
+#include <AwSocket.h>
+#include <Codec.h>
+#include <FlatElements.h>
+#include <Client.h>
+#include <memory>
+#include <thread>
+#include <utility>
+
+namespace AW {
+	namespace Tests {
+		namespace {
+			std::shared_ptr<Connection> connect(std::shared_ptr<SocketType> socket, uint32 features) {
+				return std::shared_ptr<Connection>(new Connection(socket, features));
+			}
+			// the value of a whole message, throws on bytes left over
+			template<typename T>
+			T decodeMessage(const byte* message, uint32 length) {
+				WireFormat format = detectFormat(message);
+				uint32 offset = messageBodyOffset(format, message, length);
+				T ret = Codec<T>::decode(format, message, length, offset);
+				assert_format(offset == length);
+				return ret;
+			}
+			template<typename T>
+			T receiveValue(std::shared_ptr<Connection> conn) {
+				uint32 length = 0;
+				auto message = AwSocket::receiveMessage(conn, length);
+				return decodeMessage<T>(message.get(), length);
+			}
+
+			void compression() {
+				const uint32 featureSets[] = {
+					FeatureCompression,
+					FeatureCompression | FeatureFraming,
+					FeatureCompression | FeatureFraming | FeatureBinary | FeatureInterning
+				};
+				for (auto features : featureSets) {
+					// messages arrive in pieces smaller than a packet
+					auto ends = MemorySocket::pair(1000);
+					auto a = connect(ends.first, features), b = connect(ends.second, features);
+					auto v = links(2000, 50);
+					ByteBuffer message;
+					encodeValue(a->getFormat(), v, message);
+
+					AwSocket::sendMessage(a, message.data(), message.size());
+					CHECK(receiveValue<std::vector<AW::string>>(b) == v);
+#ifdef __AW_ZLIB__
+					CHECK(ends.first->getWritten() < message.size() / 4);
+#endif
+					// the decoder sees the inflated message
+					AwSocket::sendMessage(a, message.data(), message.size());
+					FlatDocument doc;
+					AwSocket::receiveDocument(b, doc);
+					CHECK(doc.root().size() == v.size() && doc.root()[1999].asString() == v[1999]);
+
+					// small messages go as they are
+					uint64 before = ends.first->getWritten();
+					encodeValue(a->getFormat(), AW::string(t("echo")), message);
+					AwSocket::sendMessage(a, message.data(), message.size());
+					CHECK(receiveValue<AW::string>(b) == t("echo"));
+					CHECK(ends.first->getWritten() - before >= message.size());
+				}
+#ifdef __AW_ZLIB__
+				// a compressed message that does not inflate
+				auto ends = MemorySocket::pair();
+				auto a = connect(ends.first, FeatureCompression | FeatureFraming), b = connect(ends.second, FeatureCompression | FeatureFraming);
+				const byte bad[] = { COMPRESSED_MARKER, 100, 1, 2, 3, 4 };
+				AwSocket::sendFrame(a->getSocket(), bad, sizeof(bad));
+				uint32 length = 0;
+				CHECK(throws([&]() { AwSocket::receiveMessage(b, length); }));
+#endif
+			}
+
+			// callers on one connection each get their own reply, however the
+			// server orders them
+			void requestIds() {
+				const uint32 features = FeatureFraming | FeatureRequestIds | FeatureBinary;
+				const uint32 callers = 8;
+				auto ends = MemorySocket::pair(100);
+				auto a = connect(ends.first, features), b = connect(ends.second, features);
+				// every call is read before the last one is answered first
+				std::thread server([&]() {
+					std::vector<std::pair<uint32, AW::string>> calls;
+					for (uint32 i = 0; i < callers; ++i) {
+						FlatDocument doc;
+						uint32 requestId = 0;
+						AwSocket::receiveDocument(b, doc, false, requestId);
+						calls.push_back(std::make_pair(requestId, doc.root()[1][0].asString()));
+					}
+					ByteBuffer reply;
+					for (auto it = calls.rbegin(); it != calls.rend(); ++it) {
+						encodeValue(b->getFormat(), it->second, reply);
+						AwSocket::sendMessage(b, reply.data(), reply.size(), it->first);
+					}
+				});
+				std::vector<AW::string> answers(callers);
+				std::vector<std::thread> threads;
+				for (uint32 i = 0; i < callers; ++i) {
+					threads.push_back(std::thread([&, i]() {
+						try {
+							uint32 requestId = sendCall(a, t("echo"), links(callers, callers)[i]);
+							ReplyWait wait(a, requestId);
+							uint32 length = 0;
+							auto reply = AwSocket::receiveReply(a, length, requestId);
+							answers[i] = decodeMessage<AW::string>(reply.get(), length);
+						}
+						catch (std::exception&) { }
+					}));
+				}
+				for (auto& thread : threads)
+					thread.join();
+				server.join();
+				CHECK(answers == links(callers, callers));
+				CHECK(a->getKeptReplies() == 0);
+
+				// the reply of a caller that gave up is dropped when it comes
+				server = std::thread([&]() {
+					ByteBuffer reply;
+					for (uint32 i = 0; i < 2; ++i) {
+						FlatDocument doc;
+						uint32 requestId = 0;
+						AwSocket::receiveDocument(b, doc, false, requestId);
+						encodeValue(b->getFormat(), doc.root()[1][0].asString(), reply);
+						AwSocket::sendMessage(b, reply.data(), reply.size(), requestId);
+					}
+				});
+				{
+					ReplyWait gaveUp(a, sendCall(a, t("echo"), AW::string(t("gone"))));
+				}
+				uint32 requestId = sendCall(a, t("echo"), AW::string(t("here")));
+				ReplyWait wait(a, requestId);
+				uint32 length = 0;
+				auto reply = AwSocket::receiveReply(a, length, requestId);
+				server.join();
+				CHECK(decodeMessage<AW::string>(reply.get(), length) == t("here"));
+				CHECK(a->getKeptReplies() == 0);
+			}
+		}
+
+		void transportTests() {
+			compression();
+			requestIds();
+		}
+	}
+}
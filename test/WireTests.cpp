@@ -0,0 +1,235 @@
+#include "Tests.h"
+#include <Elements.h>
+#include <FlatElements.h>
+#include <Codec.h>
+#include <StringTable.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+
+namespace AW {
+	namespace Tests {
+		namespace {
+			const WireFormat formats[] = { WireFormat::Text, WireFormat::Binary };
+
+			template<typename T>
+			ByteBuffer encodeValue(WireFormat format, const T& v) {
+				CodecSizes sizes;
+				ByteBuffer ret(Codec<T>::size(format, v, sizes));
+				AW::byte* out = ret.data();
+				Codec<T>::encode(format, out, v, sizes);
+				CHECK(out == ret.data() + ret.size());
+				return ret;
+			}
+			template<typename T>
+			T decodeValue(const ByteBuffer& message) {
+				WireFormat format = detectFormat(message.data());
+				AW::uint32 offset = messageBodyOffset(format, message.data(), message.size());
+				T ret = Codec<T>::decode(format, message.data(), message.size(), offset);
+				CHECK(offset == message.size());
+				return ret;
+			}
+			template<typename T>
+			bool roundTrips(WireFormat format, const T& v) {
+				return decodeValue<T>(encodeValue(format, v)) == v;
+			}
+			template<typename...T>
+			ByteBuffer encodeTupleValue(WireFormat format, const T&... v) {
+				CodecSizes sizes;
+				ByteBuffer ret(tupleSize(format, sizes, v...));
+				AW::byte* out = ret.data();
+				encodeTuple(format, out, sizes, v...);
+				CHECK(out == ret.data() + ret.size());
+				return ret;
+			}
+			ByteBuffer encodeElement(WireFormat format, ElementBase& e) {
+				ByteBuffer ret(e.encodedSize(format));
+				AW::byte* out = ret.data();
+				e.encodeTo(format, out);
+				CHECK(out == ret.data() + ret.size());
+				return ret;
+			}
+			std::shared_ptr<const AW::byte> share(const ByteBuffer& message) {
+				std::shared_ptr<AW::byte> ret(new AW::byte[message.size()], std::default_delete<AW::byte[]>());
+				memcpy(ret.get(), message.data(), message.size());
+				return ret;
+			}
+
+			void typedRoundTrips() {
+				for (auto format : formats) {
+					CHECK(roundTrips<AW::uint32>(format, 0));
+					CHECK(roundTrips<AW::uint32>(format, 0xffffffffu));
+					CHECK(roundTrips<AW::int32>(format, -123456));
+					CHECK(roundTrips<AW::real64>(format, -1.5e300));
+					CHECK(roundTrips<AW::string>(format, t("")));
+					CHECK(roundTrips<AW::string>(format, t("<tt 1> not a header")));
+					CHECK(roundTrips(format, links(300, 300)));
+					CHECK(roundTrips(format, std::vector<AW::uint32>{ 1, 0x80000000u, 7 }));
+					CHECK(roundTrips(format, std::vector<AW::int32>()));
+					CHECK(roundTrips(format, std::vector<AW::real64>{ 0.25, -2.0 }));
+					CHECK(roundTrips(format, std::map<AW::string, AW::uint32>{ { t("a"), 1 }, { t("bbb"), 3 } }));
+					CHECK(roundTrips(format, std::vector<std::vector<AW::string>>{ { t("x") }, { }, links(20, 20) }));
+					CHECK(roundTrips(format, std::map<AW::string, std::vector<AW::uint32>>{ { t("k"), { 1, 2 } }, { t("l"), { } } }));
+					CHECK(roundTrips(format, std::vector<std::map<AW::string, std::vector<AW::string>>>{ { { t("deep"), links(3, 3) } } }));
+
+					auto tuple = std::make_tuple(AW::string(t("name")), AW::uint32(9), std::vector<AW::string>{ t("a") });
+					auto message = encodeTupleValue(format, std::get<0>(tuple), std::get<1>(tuple), std::get<2>(tuple));
+					CHECK((decodeValue<std::tuple<AW::string, AW::uint32, std::vector<AW::string>>>(message) == tuple));
+				}
+				// the binary format is the smaller one
+				CHECK(encodeValue(WireFormat::Binary, links(100, 100)).size() < encodeValue(WireFormat::Text, links(100, 100)).size());
+			}
+
+			// the typed codecs and the element classes write the same bytes
+			void elementsMatchCodecs() {
+				for (auto format : formats) {
+					auto v = links(50, 50);
+					TupleType tuple;
+					for (auto& s : v)
+						tuple.add(std::shared_ptr<ElementBase>(new Element<AW::string>(s)));
+					CHECK(encodeElement(format, tuple) == encodeValue(format, v));
+
+					std::vector<AW::uint32> numbers{ 3, 1, 4, 1, 5 };
+					CHECK(encodeElement(format, *makePackedElement(numbers)) == encodeValue(format, numbers));
+
+					MapType map;
+					map.add(std::shared_ptr<ElementBase>(new Element<AW::string>(t("one"))), std::shared_ptr<ElementBase>(new Element<AW::uint32>(1)));
+					map.add(std::shared_ptr<ElementBase>(new Element<AW::string>(t("two"))), std::shared_ptr<ElementBase>(new Element<AW::uint32>(2)));
+					CHECK(encodeElement(format, map) == encodeValue(format, std::map<AW::string, AW::uint32>{ { t("one"), 1 }, { t("two"), 2 } }));
+				}
+			}
+
+			// a decoded tree encodes back to the bytes it came from
+			void decoderRoundTrips() {
+				for (auto format : formats) {
+					auto message = encodeValue(format, std::map<AW::string, std::vector<AW::string>>{ { t("k"), links(10, 4) }, { t("z"), { } } });
+					auto buffer = share(message);
+					auto tree = Decoder(buffer, message.size()).decode();
+					CHECK(encodeElement(format, *tree) == message);
+
+					auto text = encodeValue(format, AW::string(t("view")));
+					auto textBuffer = share(text);
+					auto s = std::dynamic_pointer_cast<Element<AW::string>>(Decoder(textBuffer, text.size()).decode());
+					CHECK(s != nullptr && s->getValue() == t("view"));
+					// a view into the received buffer, not a copy
+					CHECK(s != nullptr && reinterpret_cast<const AW::byte*>(s->getView().data) > textBuffer.get() && reinterpret_cast<const AW::byte*>(s->getView().data) < textBuffer.get() + text.size());
+				}
+
+				// legacy text reader
+				auto message = encodeValue(WireFormat::Text, std::vector<AW::string>{ t("a"), t("bc") });
+				std::basic_stringstream<AW::character> ss;
+				ss << AW::string(reinterpret_cast<const AW::character*>(message.data()), message.size() / sizeof(AW::character));
+				auto tuple = std::dynamic_pointer_cast<TupleType>(fromString(ss));
+				CHECK(tuple != nullptr && tuple->size() == 2 && tuple->get<Element<AW::string>>(1).getValue() == t("bc"));
+			}
+
+			void flatDocuments() {
+				for (auto format : formats) {
+					for (bool lazy : { false, true }) {
+						auto message = encodeTupleValue(format, AW::string(t("method")), std::map<AW::string, AW::uint32>{ { t("x"), 7 } }, std::vector<AW::uint32>{ 5, 6 });
+						FlatDocument doc;
+						doc.parse(share(message), message.size(), lazy);
+						auto root = doc.root();
+						CHECK(root.isTuple() && root.size() == 3);
+						CHECK(root[0].asStringRef() == t("method"));
+						CHECK(root[1].isMap() && root[1].key(0).asString() == t("x") && root[1].value(0).asUInt32() == 7);
+						std::vector<AW::uint32> numbers;
+						if (root[2].isPackedArray())
+							root[2].readPackedArray(numbers);
+						else
+							numbers = { root[2][0].asUInt32(), root[2][1].asUInt32() };
+						CHECK((numbers == std::vector<AW::uint32>{ 5, 6 }));
+					}
+				}
+			}
+
+			void interning() {
+				auto v = links(1000, 10);
+				auto plain = encodeValue(WireFormat::Binary, v);
+				ByteBuffer interned;
+				CHECK(StringInterner(plain.data(), plain.size()).intern(interned));
+				CHECK(interned.size() < plain.size() / 4);
+				CHECK(interned[0] == static_cast<AW::byte>(BinaryTag::StringTable));
+
+				// every reader sees the strings of the original
+				CHECK(decodeValue<std::vector<AW::string>>(interned) == v);
+				auto buffer = share(interned);
+				CHECK(encodeElement(WireFormat::Binary, *Decoder(buffer, interned.size()).decode()) == plain);
+				FlatDocument doc;
+				doc.parse(buffer, interned.size());
+				CHECK(doc.root().size() == v.size() && doc.root()[999].asString() == v[999]);
+
+				// nothing repeats, nothing to gain
+				auto unique = encodeValue(WireFormat::Binary, links(100, 100));
+				CHECK(!StringInterner(unique.data(), unique.size()).intern(interned));
+				// the text format is never interned
+				auto text = encodeValue(WireFormat::Text, v);
+				CHECK(!StringInterner(text.data(), text.size()).intern(interned));
+			}
+
+			// a message arriving one byte at a time
+			void pushDecoding() {
+				auto v = links(30, 4);
+				std::vector<ByteBuffer> messages;
+				for (auto format : formats)
+					messages.push_back(encodeTupleValue(format, AW::string(t("method")), std::map<AW::string, AW::uint32>{ { t("x"), 7 } }, v));
+				ByteBuffer interned;
+				CHECK(StringInterner(messages[1].data(), messages[1].size()).intern(interned));
+				messages.push_back(interned);
+
+				for (auto& message : messages) {
+					for (bool lazy : { false, true }) {
+						FlatDocument doc;
+						PushDecoder decoder;
+						decoder.reset(doc, lazy);
+						for (AW::uint32 received = 0; received < message.size(); ++received)
+							decoder.push(message.data(), received, message.size());
+						// not all there yet
+						CHECK(throws([&]() { decoder.finish(share(message), message.size()); }));
+						decoder.push(message.data(), message.size(), message.size());
+						decoder.finish(share(message), message.size());
+
+						auto root = doc.root();
+						CHECK(root.isTuple() && root.size() == 3);
+						CHECK(root[0].asStringRef() == t("method"));
+						CHECK(root[1].isMap() && root[1].key(0).asString() == t("x") && root[1].value(0).asUInt32() == 7);
+						CHECK(root[2].size() == v.size() && root[2][29].asString() == v[29]);
+					}
+				}
+			}
+
+			void malformed() {
+				for (auto format : formats) {
+					ByteBuffer error;
+					encodeError(format, t("boom"), error);
+					bool named = false;
+					try {
+						throwIfError(error.data(), error.size());
+					}
+					catch (std::runtime_error& e) {
+						named = std::string(e.what()) == "boom";
+					}
+					CHECK(named);
+
+					auto message = encodeValue(format, links(3, 3));
+					CHECK(throws([&]() { decodeValue<std::vector<AW::string>>(ByteBuffer(message.begin(), message.end() - 1)); }));
+					CHECK(throws([&]() { decodeValue<AW::uint32>(message); }));
+				}
+				AW::byte none = 0;
+				CHECK(throws([&]() { throwIfError(&none, 0); }));
+				CHECK(throws([&]() { Decoder(std::shared_ptr<const AW::byte>(new AW::byte[1], std::default_delete<AW::byte[]>()), 0).decode(); }));
+			}
+		}
+
+		void wireTests() {
+			typedRoundTrips();
+			elementsMatchCodecs();
+			decoderRoundTrips();
+			flatDocuments();
+			interning();
+			pushDecoding();
+			malformed();
+		}
+	}
+}
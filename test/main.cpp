@@ -1,12 +1,27 @@
-
 #include <Server.h>
 #include <Client.h>
 #include <iostream>
+#include <string>
+#include "Tests.h"
 using namespace std;
 
-int main() {
+int main(int argc, char** argv) {
 
 	AW::Server<AW::string, AW::string> aw;
 
+	if (argc > 1 && string(argv[1]) == "bench") {
+		AW::Tests::benchmarks();
+		return AW::Tests::failures() != 0 ? 1 : 0;
+	}
+
+	AW::Tests::wireTests();
+	AW::Tests::transportTests();
+	AW::Tests::rpcTests();
+
+	if (AW::Tests::failures() != 0) {
+		cout << AW::Tests::failures() << " checks failed" << endl;
+		return 1;
+	}
+	cout << "all tests passed" << endl;
 	return 0;
-}
\ No newline at end of file
+}